@@ -243,10 +243,10 @@ void cmd_save(int cmdc, char **cmdv)
 
 #endif /* END OF OBSOLETED STUFF */
 
-	/* TODO FIXME: here just for testing the on-disk syncing code */
+	/* chunks are also saved in the background every few seconds */
 
-	tell("//save: calling world_regfile_sync_all");
-	world_regfile_sync_all();
+	tell("//save: flushing all unsaved chunks");
+	world_flush();
 }
 #endif /* FEAT_FULLCHUNK */
 
@@ -260,3 +260,14 @@ void cmd_slap(int cmdc, char **cmdv)
 
 	say("/me slaps %s around a bit with a large trout", cmdv[1]);
 }
+
+void cmd_stats(int cmdc, char **cmdv)
+{
+	if (cmdc != 1)
+	{
+		tell("usage: //stats");
+		return;
+	}
+
+	world_persist_stats();
+}
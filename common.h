@@ -13,6 +13,11 @@ struct options
 	int scale;
 	char *wndsize;
 	char *jumpfile;
+	char *worlddir;
+	int memlimit;
+	bool preload;
+	int threads;
+	char *compactdir;
 } opt;
 
 /* teleportation */
@@ -31,6 +31,11 @@ struct options opt = {
 	.scale = 1,
 	.wndsize = 0,
 	.jumpfile = 0,
+	.worlddir = 0,
+	.memlimit = 0,
+	.preload = false,
+	.threads = 0,
+	.compactdir = 0,
 };
 
 void load_colors(char **lines);
@@ -52,6 +57,11 @@ int mcmap_main(int argc, char **argv)
 		{ "size", 's', 0, G_OPTION_ARG_STRING, &opt.wndsize, "Fixed-size window size", "WxH" },
 		{ "scale", 'x', 0, G_OPTION_ARG_INT, &opt.scale, "Zoom factor", "N" },
 		{ "jumps", 'j', 0, G_OPTION_ARG_STRING, &opt.jumpfile, "File containing list of jumps", "FILENAME" },
+		{ "world", 'w', 0, G_OPTION_ARG_STRING, &opt.worlddir, "Directory to store the world in", "DIR" },
+		{ "memory", 'M', 0, G_OPTION_ARG_INT, &opt.memlimit, "Keep at most this much chunk data in memory (needs -w)", "MB" },
+		{ "preload", 'L', 0, G_OPTION_ARG_NONE, &opt.preload, "Load the whole world directory at startup (needs -w)", NULL },
+		{ "threads", 'T', 0, G_OPTION_ARG_INT, &opt.threads, "Threads to use for preloading and saving (default: one per CPU)", "N" },
+		{ "compact-regions", 0, 0, G_OPTION_ARG_STRING, &opt.compactdir, "Rewrite the region files of a world directory without holes, and exit", "DIR" },
 		{ NULL }
 	};
 
@@ -64,6 +74,9 @@ int mcmap_main(int argc, char **argv)
 		die(gopt_error->message);
 	}
 
+	if (opt.compactdir)
+		return world_compact(opt.compactdir);
+
 	if (argc != 2)
 	{
 		char *usage = g_option_context_get_help(gopt, true, 0);
@@ -81,6 +94,26 @@ int mcmap_main(int argc, char **argv)
 		dief("Unreasonable scale factor: %d", opt.scale);
 	}
 
+	if (opt.memlimit < 0)
+	{
+		dief("Invalid memory budget: %d", opt.memlimit);
+	}
+
+	if (opt.preload && !opt.worlddir)
+	{
+		die("Preloading needs a world directory to load from (-w)");
+	}
+
+	if (opt.preload && opt.memlimit)
+	{
+		die("Preloading the whole world does not fit in a memory budget");
+	}
+
+	if (opt.threads < 0)
+	{
+		dief("Invalid number of threads: %d", opt.threads);
+	}
+
 	int wnd_w = 512, wnd_h = 512;
 
 	if (opt.wndsize)
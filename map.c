@@ -1,15 +1,21 @@
+#include <errno.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <SDL.h>
 #include <SDL_ttf.h>
+#include <zlib.h>
 
 #include "config.h"
 #include "types.h"
 #include "platform.h"
+#include "common.h"
 #include "block.h"
+#include "console.h"
 #include "protocol.h"
 #include "proxy.h"
 #include "world.h"
@@ -42,6 +48,11 @@ int map_scale = 1;
 struct map_mode *map_mode = 0;
 struct map_mode *map_modes[256];
 
+#define TILE_SAVE_INTERVAL 60.0 /* seconds between saving repainted tiles */
+
+static GTimer *tile_timer = 0;
+static GThreadPool *tile_pool = 0; /* compresses and writes saved tiles */
+
 G_LOCK_DEFINE_STATIC(map_mutex);
 
 inline uint32_t pack_rgb(rgba_t rgba)
@@ -52,6 +63,7 @@ inline uint32_t pack_rgb(rgba_t rgba)
 }
 
 static void map_destroy_region(gpointer gp);
+static void map_write_tile(gpointer data, gpointer user_data);
 
 void map_init(SDL_Surface *screen)
 {
@@ -60,6 +72,8 @@ void map_init(SDL_Surface *screen)
 	map_gshift = screen_fmt->Gshift;
 	map_bshift = screen_fmt->Bshift;
 	regions = g_hash_table_new_full(coord_glib_hash, coord_glib_equal, 0, map_destroy_region);
+	tile_timer = g_timer_new();
+	tile_pool = g_thread_pool_new(map_write_tile, 0, 1, false, 0);
 
 	/* initialize map modes */
 	map_modes['1'] = map_init_surface_mode();
@@ -70,6 +84,14 @@ void map_init(SDL_Surface *screen)
 
 rgba_t map_water_color(struct chunk *c, rgba_t rgba, jint bx, jint bz, jint y)
 {
+	if (y == c->height[bx][bz])
+	{
+		/* surface water; depth is known without scanning the stack */
+		for (int d = c->water_depth[bx][bz]; d > 1; d--)
+			TRANSFORM_RGB(x*7/8);
+		return rgba;
+	}
+
 	while (--y >= 0 && IS_WATER(c->blocks[bx][bz][y]))
 		TRANSFORM_RGB(x*7/8);
 	return rgba;
@@ -113,6 +135,11 @@ static struct map_region *map_create_region(coord_t rc)
 
 	region->dirty_flag = 0;
 	memset(region->dirty_chunk, 0, sizeof region->dirty_chunk);
+	memset(region->dirty_column, 0, sizeof region->dirty_column);
+
+	region->tile_key = 0;
+	region->tile_dirty = false;
+	memset(region->tile_versions, 0, sizeof region->tile_versions);
 
 	return region;
 }
@@ -122,6 +149,7 @@ static void map_destroy_region(gpointer rp)
 	struct map_region *region = rp;
 	if (region->surf)
 		SDL_FreeSurface(region->surf);
+	g_free(region->tile_key);
 	g_free(rp);
 }
 
@@ -138,44 +166,73 @@ inline void map_repaint(void)
 	SDL_PushEvent(&e);
 }
 
-static void map_update_chunk(coord_t cc)
+static void map_update_region(coord_t cc)
 {
-	struct chunk *c = world_chunk(cc, false);
+	struct map_region *region = map_get_region(cc, true);
+	region->dirty_flag = 1;
+	for (jint cz = 0; cz < REGION_SIZE; cz++)
+		for (jint cx = 0; cx < REGION_SIZE; cx++)
+		{
+			coord_t chunk_cc = COORD(cc.x + cx*CHUNK_XSIZE, cc.z + cz*CHUNK_ZSIZE);
+			if (world_snapshot_chunk(chunk_cc) || world_chunk_evicted(chunk_cc))
+			{
+				BITSET_SET(region->dirty_chunk, cz*REGION_SIZE+cx);
+				memset(region->dirty_column[cz*REGION_SIZE+cx], 0xff, sizeof region->dirty_column[0]);
+			}
+		}
+}
 
-	if (!c)
-		return;
+void map_update_columns(coord_t cc, uint8_t *columns)
+{
+	G_LOCK(map_mutex);
 
 	struct map_region *region = map_get_region(cc, true);
+	int cidx = CHUNK_ZIDX(REGION_ZOFF(cc.z))*REGION_SIZE + CHUNK_XIDX(REGION_XOFF(cc.x));
+
 	region->dirty_flag = 1;
-	BITSET_SET(region->dirty_chunk, CHUNK_ZIDX(REGION_ZOFF(cc.z))*REGION_SIZE + CHUNK_XIDX(REGION_XOFF(cc.x)));
+	BITSET_SET(region->dirty_chunk, cidx);
+	for (size_t i = 0; i < sizeof region->dirty_column[cidx]; i++)
+		region->dirty_column[cidx][i] |= columns[i];
+
+	G_UNLOCK(map_mutex);
+
+	map_repaint();
 }
 
-static void map_update_region(coord_t cc)
+bool map_take_dirty(struct map_region *region, int cidx, uint8_t *columns)
 {
-	struct region *r = world_region(cc, false);
+	G_LOCK(map_mutex);
 
-	if (!r)
-		return;
+	bool dirty = BITSET_TEST(region->dirty_chunk, cidx);
 
-	struct map_region *region = map_get_region(cc, true);
-	region->dirty_flag = 1;
-	for (jint cz = 0; cz < REGION_SIZE; cz++)
-		for (jint cx = 0; cx < REGION_SIZE; cx++)
-			if (r->chunks[cx][cz])
-				BITSET_SET(region->dirty_chunk, cz*REGION_SIZE+cx);
+	if (dirty)
+	{
+		memcpy(columns, region->dirty_column[cidx], sizeof region->dirty_column[cidx]);
+		memset(region->dirty_column[cidx], 0, sizeof region->dirty_column[cidx]);
+		BITSET_CLEAR(region->dirty_chunk, cidx);
+	}
+
+	G_UNLOCK(map_mutex);
+
+	return dirty;
 }
 
-void map_update(coord_t c1, coord_t c2)
+struct map_region *map_view_region(coord_t cc)
 {
+	/* regions only indexed from disk get a map region once they come into view */
+
 	G_LOCK(map_mutex);
 
-	for (jint cz = c1.z; cz <= c2.z; cz += CHUNK_ZSIZE)
-		for (jint cx = c1.x; cx <= c2.x; cx += CHUNK_XSIZE)
-			map_update_chunk(COORD(cx, cz));
+	struct map_region *region = map_get_region(cc, false);
+	if (!region && world_region_exists(cc))
+	{
+		map_update_region(COORD(REGION_XMASK(cc.x), REGION_ZMASK(cc.z)));
+		region = map_get_region(cc, false);
+	}
 
 	G_UNLOCK(map_mutex);
 
-	map_repaint();
+	return region;
 }
 
 void map_update_all(void)
@@ -195,6 +252,254 @@ void map_update_all(void)
 	G_UNLOCK(map_mutex);
 }
 
+/* persistent tiles: region surfaces saved in the world directory, one
+   set per map view, so that chunks unchanged since need no repainting */
+
+#define TILE_MAGIC "MCT1"
+#define TILE_VERSIONS_SIZE (REGION_SIZE*REGION_SIZE*4)
+#define TILE_SIZE (TILE_VERSIONS_SIZE + REGION_XSIZE*REGION_ZSIZE*3)
+
+static char *map_tile_path(coord_t rc, const char *key)
+{
+	return g_strdup_printf("%s/tiles/%s/r.%d.%d.tile", opt.worlddir, key, REGION_XIDX(rc.x), REGION_ZIDX(rc.z));
+}
+
+static bool map_load_tile(struct map_region *region, const char *key)
+{
+	char *path = map_tile_path(region->key, key);
+	gchar *contents;
+	gsize len;
+
+	if (!g_file_get_contents(path, &contents, &len, 0))
+	{
+		g_free(path);
+		return false;
+	}
+
+	unsigned char *tile = g_malloc(TILE_SIZE);
+	uLongf tile_len = TILE_SIZE;
+
+	if (len < 4 || memcmp(contents, TILE_MAGIC, 4) != 0 ||
+	    uncompress(tile, &tile_len, (unsigned char *)contents + 4, len - 4) != Z_OK ||
+	    tile_len != TILE_SIZE)
+	{
+		log_print("[WARN] Ignoring corrupted map tile: %s", path);
+		g_free(tile);
+		g_free(contents);
+		g_free(path);
+		return false;
+	}
+
+	g_free(contents);
+	g_free(path);
+
+	for (int i = 0; i < REGION_SIZE*REGION_SIZE; i++)
+		region->tile_versions[i] = jint_read(tile + 4*i);
+
+	SDL_LockSurface(region->surf);
+
+	unsigned char *rgb = tile + TILE_VERSIONS_SIZE;
+	for (int z = 0; z < REGION_ZSIZE; z++)
+	{
+		uint32_t *p = (uint32_t *)((unsigned char *)region->surf->pixels + z*region->surf->pitch);
+		for (int x = 0; x < REGION_XSIZE; x++, rgb += 3)
+			*p++ = pack_rgb(RGB(rgb[0], rgb[1], rgb[2]));
+	}
+
+	SDL_UnlockSurface(region->surf);
+
+	g_free(tile);
+	return true;
+}
+
+struct tile_job
+{
+	char *dir, *path;
+	unsigned char *tile; /* TILE_SIZE bytes, before compression */
+};
+
+static void map_write_tile(gpointer data, gpointer user_data)
+{
+	/* tile worker: the UI thread has better things to do than deflate */
+
+	struct tile_job *job = data;
+
+	/* tiles are mostly flat colour; the fastest level does fine */
+	uLongf zlen = compressBound(TILE_SIZE);
+	unsigned char *zdata = g_malloc(4 + zlen);
+	memcpy(zdata, TILE_MAGIC, 4);
+	if (compress2(zdata + 4, &zlen, job->tile, TILE_SIZE, Z_BEST_SPEED) != Z_OK)
+		die("map tile compression failed");
+
+	GError *error = 0;
+
+	/* the tiles are only a cache; losing one just costs a repaint */
+	if (g_mkdir_with_parents(job->dir, 0777) != 0)
+		log_print("[WARN] Unable to create map tile directory: %s: %s", job->dir, g_strerror(errno));
+	else if (!g_file_set_contents(job->path, (gchar *)zdata, 4 + zlen, &error))
+	{
+		log_print("[WARN] Unable to save map tile: %s", error->message);
+		g_error_free(error);
+	}
+
+	g_free(zdata);
+	g_free(job->tile);
+	g_free(job->path);
+	g_free(job->dir);
+	g_free(job);
+}
+
+static void map_save_tile(struct map_region *region)
+{
+	/* UI thread: take a copy of the surface for the tile worker */
+
+	unsigned char *tile = g_malloc(TILE_SIZE);
+
+	for (int i = 0; i < REGION_SIZE*REGION_SIZE; i++)
+		jint_write(tile + 4*i, region->tile_versions[i]);
+
+	SDL_LockSurface(region->surf);
+
+	unsigned char *rgb = tile + TILE_VERSIONS_SIZE;
+	for (int z = 0; z < REGION_ZSIZE; z++)
+	{
+		uint32_t *p = (uint32_t *)((unsigned char *)region->surf->pixels + z*region->surf->pitch);
+		for (int x = 0; x < REGION_XSIZE; x++, p++)
+		{
+			*rgb++ = *p >> map_rshift;
+			*rgb++ = *p >> map_gshift;
+			*rgb++ = *p >> map_bshift;
+		}
+	}
+
+	SDL_UnlockSurface(region->surf);
+
+	struct tile_job *job = g_new(struct tile_job, 1);
+	job->dir = g_strdup_printf("%s/tiles/%s", opt.worlddir, region->tile_key);
+	job->path = map_tile_path(region->key, region->tile_key);
+	job->tile = tile;
+	g_thread_pool_push(tile_pool, job, 0);
+
+	region->tile_dirty = false;
+}
+
+static void map_tile_refresh(struct map_region *region)
+{
+	/* chunks painted before their contents reached the file can be
+	   stamped once they have, if not changed (and so dirty) since */
+
+	int snap = world_snapshot_begin();
+
+	for (jint cz = 0; cz < REGION_SIZE; cz++)
+		for (jint cx = 0; cx < REGION_SIZE; cx++)
+		{
+			int cidx = cz*REGION_SIZE + cx;
+			coord_t cc = COORD(region->key.x + cx*CHUNK_XSIZE, region->key.z + cz*CHUNK_ZSIZE);
+
+			if (region->tile_versions[cidx])
+				continue;
+
+			gint version = world_chunk_version(cc);
+			if (!version || !world_snapshot_chunk(cc))
+				continue;
+
+			G_LOCK(map_mutex);
+			bool dirty = BITSET_TEST(region->dirty_chunk, cidx);
+			G_UNLOCK(map_mutex);
+
+			if (!dirty)
+			{
+				region->tile_versions[cidx] = version;
+				region->tile_dirty = true;
+			}
+		}
+
+	world_snapshot_end(snap);
+}
+
+void map_tile_switch(struct map_region *region, char *key)
+{
+	/* UI thread: make the surface belong to the tile of the current view;
+	   key is 0 when there is nothing to keep on disk */
+
+	if (!opt.worlddir)
+		key = 0;
+
+	if (key == region->tile_key || (key && region->tile_key && strcmp(key, region->tile_key) == 0))
+		return;
+
+	if (region->tile_key)
+	{
+		map_tile_refresh(region);
+		if (region->tile_dirty)
+			map_save_tile(region);
+	}
+
+	g_free(region->tile_key);
+	region->tile_key = g_strdup(key);
+	region->tile_dirty = false;
+	memset(region->tile_versions, 0, sizeof region->tile_versions);
+
+	if (!key || !map_load_tile(region, key))
+		return;
+
+	/* chunks whose file contents match the tile need no painting */
+
+	for (jint cz = 0; cz < REGION_SIZE; cz++)
+		for (jint cx = 0; cx < REGION_SIZE; cx++)
+		{
+			int cidx = cz*REGION_SIZE + cx;
+			coord_t cc = COORD(region->key.x + cx*CHUNK_XSIZE, region->key.z + cz*CHUNK_ZSIZE);
+			gint version = region->tile_versions[cidx];
+			BITSET(columns, CHUNK_XSIZE*CHUNK_ZSIZE);
+
+			if (version && version == world_chunk_version(cc))
+				map_take_dirty(region, cidx, columns);
+			else
+				region->tile_versions[cidx] = 0;
+		}
+}
+
+void map_save_tiles(void)
+{
+	/* UI thread: write out the tiles changed since they were saved */
+
+	GHashTableIter region_iter;
+	struct map_region *region;
+	GPtrArray *tiled = g_ptr_array_new();
+
+	G_LOCK(map_mutex);
+
+	g_hash_table_iter_init(&region_iter, regions);
+
+	while (g_hash_table_iter_next(&region_iter, NULL, (gpointer *) &region))
+		if (region->tile_key)
+			g_ptr_array_add(tiled, region);
+
+	G_UNLOCK(map_mutex);
+
+	for (unsigned i = 0; i < tiled->len; i++)
+	{
+		region = g_ptr_array_index(tiled, i);
+		map_tile_refresh(region);
+		if (region->tile_dirty)
+			map_save_tile(region);
+	}
+
+	g_ptr_array_free(tiled, true);
+	g_timer_start(tile_timer);
+}
+
+void map_close_tiles(void)
+{
+	/* UI thread, before exiting: save the changed tiles, and wait until
+	   they have been written */
+
+	map_save_tiles();
+	g_thread_pool_free(tile_pool, false, true);
+	tile_pool = 0;
+}
+
 void map_set_mode(struct map_mode *mode)
 {
 	map_mode = mode;
@@ -244,9 +549,9 @@ inline void map_blit_scaled(SDL_Surface *dest, SDL_Surface *src, int sx, int sy,
 	}
 }
 
-static void map_draw_entity_marker(void *idp, void *ep, void *userdata)
+static void map_draw_entity_marker(struct entity *e, void *userdata)
 {
-	map_mode->draw_entity(map_mode->data, (SDL_Surface *) userdata, (struct entity *) ep);
+	map_mode->draw_entity(map_mode->data, (SDL_Surface *) userdata, e);
 }
 
 static void map_draw_status_bar(SDL_Surface *screen)
@@ -264,7 +569,7 @@ static void map_draw_status_bar(SDL_Surface *screen)
 		int mx, my;
 		SDL_GetMouseState(&mx, &my);
 		hcc = map_mode->s2w(map_mode->data, mx, my);
-		struct chunk *hc = world_chunk(coord3_xz(hcc), false);
+		struct chunk *hc = world_snapshot_chunk(coord3_xz(hcc));
 		if (!hc) goto no_block_info;
 		jint hcx = CHUNK_XOFF(hcc.x);
 		jint hcz = CHUNK_ZOFF(hcc.z);
@@ -275,8 +580,11 @@ static void map_draw_status_bar(SDL_Surface *screen)
 		{
 			int depth = 1;
 			jint h = hcc.y;
-			while (--h >= 0 && IS_WATER(hc->blocks[hcx][hcz][h]))
-				depth++;
+			if (h == hc->height[hcx][hcz])
+				depth = hc->water_depth[hcx][hcz];
+			else
+				while (--h >= 0 && IS_WATER(hc->blocks[hcx][hcz][h]))
+					depth++;
 			left_text = g_strdup_printf("water (%d deep)", depth);
 		}
 		else
@@ -310,6 +618,12 @@ no_block_info:
 
 void map_draw(SDL_Surface *screen)
 {
+	/* chunks seen while drawing stay valid until the end; world_publish
+	   swaps them in one at a time, so a frame may still mix chunks from
+	   before and after a publish, to be fixed up by the next repaint */
+
+	int snap = world_snapshot_begin();
+
 	/* clear the window */
 
 	SDL_Rect rect_screen = { .x = 0, .y = 0, .w = screen->w, .h = screen->h };
@@ -323,11 +637,18 @@ void map_draw(SDL_Surface *screen)
 
 	map_mode->draw_player(map_mode->data, screen);
 
-	G_LOCK(entity_mutex);
-	g_hash_table_foreach(world_entities, map_draw_entity_marker, screen);
-	G_UNLOCK(entity_mutex);
+	coord3_t s1 = map_mode->s2w(map_mode->data, 0, 0);
+	coord3_t s2 = map_mode->s2w(map_mode->data, map_w-1, map_h-1);
+	coord_t c1 = COORD(s1.x < s2.x ? s1.x : s2.x, s1.z < s2.z ? s1.z : s2.z);
+	coord_t c2 = COORD(s1.x < s2.x ? s2.x : s1.x, s1.z < s2.z ? s2.z : s1.z);
+	world_snapshot_entities(c1, c2, map_draw_entity_marker, screen);
 
 	/* the status bar */
 
 	map_draw_status_bar(screen);
+
+	world_snapshot_end(snap);
+
+	if (g_timer_elapsed(tile_timer, 0) >= TILE_SAVE_INTERVAL)
+		map_save_tiles();
 }
@@ -9,6 +9,10 @@ struct map_region
 	SDL_Surface *surf;
 	int dirty_flag;
 	BITSET(dirty_chunk, REGION_SIZE*REGION_SIZE);
+	BITSET(dirty_column[REGION_SIZE*REGION_SIZE], CHUNK_XSIZE*CHUNK_ZSIZE);
+	char *tile_key; /* persistent tile the surface belongs to, or 0 */
+	bool tile_dirty; /* painted since the tile was saved */
+	gint tile_versions[REGION_SIZE*REGION_SIZE]; /* world_chunk_version of the painted chunks, 0 if unknown */
 };
 
 struct map_mode
@@ -23,6 +27,7 @@ struct map_mode
 	void (*draw_map)(void *data, SDL_Surface *screen);
 	void (*draw_player)(void *data, SDL_Surface *screen);
 	void (*draw_entity)(void *data, SDL_Surface *screen, struct entity *e);
+	char *(*tile_key)(void *data);
 };
 
 struct flat_mode
@@ -34,6 +39,7 @@ struct flat_mode
 	void (*update_time)(void *data);
 	jint (*mapped_y)(void *data, struct chunk *c, unsigned char *b, jint bx, jint bz);
 	rgba_t (*block_color)(void *data, struct chunk *c, unsigned char *b, jint bx, jint bz, jint y);
+	char *(*tile_key)(void *data); /* 0 if the current view is not worth keeping on disk */
 };
 
 extern struct map_mode *map_mode;
@@ -76,8 +82,14 @@ bool map_zoom(int dscale);
 
 struct map_region *map_get_region(coord_t cc, bool gen);
 
-void map_update(coord_t c1, coord_t c2);
+void map_update_columns(coord_t cc, uint8_t *columns);
 void map_update_all(void);
+struct map_region *map_view_region(coord_t cc);
+bool map_take_dirty(struct map_region *region, int cidx, uint8_t *columns);
+
+void map_tile_switch(struct map_region *region, char *key);
+void map_save_tiles(void);
+void map_close_tiles(void);
 
 void map_set_mode(struct map_mode *mode);
 void map_mode_changed(void);
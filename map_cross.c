@@ -85,6 +85,12 @@ static void update_time(void *data)
 	return;
 }
 
+static char *tile_key(void *data)
+{
+	/* one per altitude would be too many to keep around */
+	return 0;
+}
+
 static jint mapped_y(void *data, struct chunk *c, unsigned char *b, jint bx, jint bz)
 {
 	struct state *state = data;
@@ -110,5 +116,6 @@ struct map_mode *map_init_cross_mode(void)
 	flat_mode.update_time = update_time;
 	flat_mode.mapped_y = mapped_y;
 	flat_mode.block_color = block_color;
+	flat_mode.tile_key = tile_key;
 	return map_init_flat_mode(flat_mode);
 }
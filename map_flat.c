@@ -65,13 +65,15 @@ static coord3_t s2w(void *data, int sx, int sy)
 	coord_t cc = s2w_offset(sx, sy, &xo, &zo);
 
 	jint y = -1;
-	struct chunk *c = world_chunk(cc, false);
+	int snap = world_snapshot_begin();
+	struct chunk *c = world_snapshot_chunk(cc);
 	if (c)
 	{
 		jint cx = CHUNK_XOFF(cc.x);
 		jint cz = CHUNK_ZOFF(cc.z);
 		y = state->flat_mode.mapped_y(state->flat_mode.data, c, c->blocks[cx][cz], cx, cz);
 	}
+	world_snapshot_end(snap);
 
 	return COORD3(cc.x, y, cc.z);
 }
@@ -118,6 +120,12 @@ static void update_time(void *data)
 	state->flat_mode.update_time(state->flat_mode.data);
 }
 
+static char *tile_key(void *data)
+{
+	struct state *state = data;
+	return state->flat_mode.tile_key(state->flat_mode.data);
+}
+
 static void draw_player(void *data, SDL_Surface *screen)
 {
 	/* determine transform from player direction */
@@ -220,17 +228,22 @@ static void draw_entity(void *data, SDL_Surface *screen, struct entity *e)
 	SDL_FillRect(screen, &r, pack_rgb(ignore_alpha(color)));
 }
 
-static void paint_chunk(void *data, SDL_Surface *region, coord_t cc)
+static bool paint_chunk(void *data, SDL_Surface *region, coord_t cc, uint8_t *columns)
 {
 	struct state *state = data;
 
 	jint cxo = CHUNK_XIDX(REGION_XOFF(cc.x));
 	jint czo = CHUNK_ZIDX(REGION_ZOFF(cc.z));
 
-	struct chunk *c = world_chunk(cc, false);
+	struct chunk *c = world_snapshot_chunk(cc);
 
 	if (!c)
-		return;
+	{
+		/* evicted chunks get repainted once loaded back in */
+		if (world_chunk_evicted(cc))
+			world_request_chunk(cc);
+		return false;
+	}
 
 	SDL_LockSurface(region);
 	uint32_t pitch = region->pitch;
@@ -249,9 +262,13 @@ static void paint_chunk(void *data, SDL_Surface *region, coord_t cc)
 
 		for (jint bx = 0; bx < CHUNK_XSIZE; bx++)
 		{
-			jint y = state->flat_mode.mapped_y(state->flat_mode.data, c, b, bx, bz);
-			rgba_t rgba = state->flat_mode.block_color(state->flat_mode.data, c, b, bx, bz, y);
-			*p++ = pack_rgb(rgba);
+			if (BITSET_TEST(columns, bz*CHUNK_XSIZE + bx))
+			{
+				jint y = state->flat_mode.mapped_y(state->flat_mode.data, c, b, bx, bz);
+				rgba_t rgba = state->flat_mode.block_color(state->flat_mode.data, c, b, bx, bz, y);
+				*p = pack_rgb(rgba);
+			}
+			p++;
 			b += blocks_xpitch;
 		}
 
@@ -260,10 +277,12 @@ static void paint_chunk(void *data, SDL_Surface *region, coord_t cc)
 	}
 
 	SDL_UnlockSurface(region);
+	return true;
 }
 
 static void paint_region(void *data, struct map_region *region)
 {
+	struct state *state = data;
 	jint cidx = 0;
 
 	/* make sure the region has a surface for painting */
@@ -281,7 +300,11 @@ static void paint_region(void *data, struct map_region *region)
 		SDL_UnlockSurface(region->surf);
 	}
 
-	/* paint all dirty chunks */
+	/* start from the saved tile of this view, if there is one */
+
+	map_tile_switch(region, state->flat_mode.tile_key(state->flat_mode.data));
+
+	/* paint the dirty columns of all dirty chunks */
 
 	region->dirty_flag = 0;
 
@@ -289,13 +312,19 @@ static void paint_region(void *data, struct map_region *region)
 	{
 		for (jint cx = 0; cx < REGION_SIZE; cx++)
 		{
-			if (BITSET_TEST(region->dirty_chunk, cidx))
+			BITSET(columns, CHUNK_XSIZE*CHUNK_ZSIZE);
+
+			if (map_take_dirty(region, cidx, columns))
 			{
 				coord_t cc;
 				cc.x = region->key.x + (cx * CHUNK_XSIZE);
 				cc.z = region->key.z + (cz * CHUNK_ZSIZE);
-				paint_chunk(data, region->surf, cc);
-				BITSET_CLEAR(region->dirty_chunk, cidx);
+				gint version = world_chunk_version(cc);
+				if (paint_chunk(data, region->surf, cc, columns))
+				{
+					region->tile_versions[cidx] = version;
+					region->tile_dirty = true;
+				}
 			}
 
 			cidx++;
@@ -350,7 +379,7 @@ static void draw_map(void *data, SDL_Surface *screen)
 			/* get the region flat, paint it if dirty */
 
 			coord_t rc = COORD(reg_x * REGION_XSIZE, reg_z * REGION_ZSIZE);
-			struct map_region *region = map_get_region(rc, false);
+			struct map_region *region = map_view_region(rc);
 
 			if (!region)
 				continue; /* nothing to draw */
@@ -397,5 +426,6 @@ struct map_mode *map_init_flat_mode(struct flat_mode flat_mode)
 	mode->draw_map = draw_map;
 	mode->draw_player = draw_player;
 	mode->draw_entity = draw_entity;
+	mode->tile_key = tile_key;
 	return mode;
 }
@@ -92,16 +92,25 @@ static void update_player_pos(void *data)
 
 	if (state->chop)
 	{
-		unsigned char *stack = world_stack(coord3_xz(player_pos), false);
+		coord_t cc = coord3_xz(player_pos);
+		int snap = world_snapshot_begin();
+		struct chunk *c = world_snapshot_chunk(cc);
 		jint old_ceiling_y = state->ceiling_y;
-		if (stack && player_pos.y >= 0 && player_pos.y < CHUNK_YSIZE)
+		if (c && player_pos.y >= 0 && player_pos.y < CHUNK_YSIZE)
 		{
-			for (state->ceiling_y = player_pos.y + 2; state->ceiling_y < CHUNK_YSIZE; state->ceiling_y++)
+			unsigned char *stack = c->blocks[CHUNK_XOFF(cc.x)][CHUNK_ZOFF(cc.z)];
+			jint top = c->height_solid[CHUNK_XOFF(cc.x)][CHUNK_ZOFF(cc.z)];
+
+			/* nothing above the topmost solid block can be a ceiling */
+			for (state->ceiling_y = player_pos.y + 2; state->ceiling_y <= top; state->ceiling_y++)
 				if (!IS_HOLLOW(stack[state->ceiling_y]))
 					break;
+			if (state->ceiling_y > top)
+				state->ceiling_y = CHUNK_YSIZE;
 			if (state->ceiling_y != old_ceiling_y)
 				map_update_all();
 		}
+		world_snapshot_end(snap);
 	}
 }
 
@@ -137,6 +146,26 @@ static void update_time(void *data)
 	}
 }
 
+static char *tile_key(void *data)
+{
+	struct state *state = data;
+
+	/* views chopped at a ceiling follow the player underground; not kept */
+	if (state->chop && state->ceiling_y < CHUNK_YSIZE)
+		return 0;
+
+#ifdef FEAT_FULLCHUNK
+	if (state->lights)
+	{
+		static char key[32];
+		g_snprintf(key, sizeof key, "surface-lights%d", state->darken);
+		return key;
+	}
+#endif
+
+	return "surface";
+}
+
 static jint mapped_y(void *data, struct chunk *c, unsigned char *b, jint bx, jint bz)
 {
 	struct state *state = data;
@@ -237,5 +266,6 @@ struct map_mode *map_init_surface_mode(void)
 	flat_mode.update_time = update_time;
 	flat_mode.mapped_y = mapped_y;
 	flat_mode.block_color = block_color;
+	flat_mode.tile_key = tile_key;
 	return map_init_flat_mode(flat_mode);
 }
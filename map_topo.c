@@ -32,6 +32,11 @@ static void update_time(void *data)
 	return;
 }
 
+static char *tile_key(void *data)
+{
+	return "topographic";
+}
+
 static jint mapped_y(void *data, struct chunk *c, unsigned char *b, jint bx, jint bz)
 {
 	return c->height[bx][bz];
@@ -57,5 +62,6 @@ struct map_mode *map_init_topo_mode(void)
 	flat_mode.update_time = update_time;
 	flat_mode.mapped_y = mapped_y;
 	flat_mode.block_color = block_color;
+	flat_mode.tile_key = tile_key;
 	return map_init_flat_mode(flat_mode);
 }
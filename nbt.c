@@ -5,6 +5,12 @@
 #include <glib.h>
 #include <zlib.h>
 
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "config.h"
 #include "types.h"
 #include "console.h"
@@ -15,9 +21,12 @@
 struct nbt_tag
 {
 	enum nbt_tag_type type;
+	struct nbt_arena *arena; /* the tag and its contents are from; 0 for the heap */
 
 	unsigned char namelen[2];
-	char *name;
+	char *name; /* not NUL-terminated in parsed trees */
+
+	struct nbt_tag *next; /* sibling in the containing structure or list */
 
 	union
 	{
@@ -25,404 +34,1757 @@ struct nbt_tag
 		long long longv;
 		jdouble doublev;
 		struct buffer blobv;
-		GPtrArray *structv;
+		struct
+		{
+			struct nbt_tag *first, *last;
+			unsigned count;
+			unsigned index_size; /* 0 while not indexed */
+			struct nbt_tag **index;
+		} structv;
+		struct
+		{
+			enum nbt_tag_type type; /* of the elements */
+			unsigned count;
+			void *items; /* values of numeric types, unnamed tags of the others */
+		} listv; /* also int and long arrays */
 	} data;
 };
 
+/* payload sizes of the numeric tags, both serialized and in memory */
+static const size_t nbt_fixed_size[] = {
+	[NBT_TAG_BYTE] = 1, [NBT_TAG_SHORT] = 2, [NBT_TAG_INT] = 4,
+	[NBT_TAG_LONG] = 8, [NBT_TAG_FLOAT] = 4, [NBT_TAG_DOUBLE] = 8,
+};
+
+/* per-document bump allocator: the tags of a tree and their names and
+   payloads are carved out of a few large blocks, and freeing the tree
+   frees the blocks; parsed documents are owned by their arena too */
+
+#define NBT_ARENA_BLOCK 4096
+#define NBT_ARENA_ALIGN 8
+
+struct nbt_arena
+{
+	GSList *blocks; /* everything to g_free with the arena */
+	uint8_t *next;
+	size_t left;
+	struct nbt_tag *root; /* nbt_free on this tag frees the arena */
+};
+
+struct nbt_arena *nbt_arena_new(void)
+{
+	struct nbt_arena *arena = g_new(struct nbt_arena, 1);
+
+	arena->blocks = 0;
+	arena->next = 0;
+	arena->left = 0;
+	arena->root = 0;
+
+	return arena;
+}
+
+void nbt_arena_free(struct nbt_arena *arena)
+{
+	for (GSList *b = arena->blocks; b; b = b->next)
+		g_free(b->data);
+	g_slist_free(arena->blocks);
+	g_free(arena);
+}
+
+static void *arena_own(struct nbt_arena *arena, void *mem)
+{
+	arena->blocks = g_slist_prepend(arena->blocks, mem);
+	return mem;
+}
+
+static void *arena_alloc(struct nbt_arena *arena, size_t size)
+{
+	if (!arena)
+		return g_malloc(size);
+
+	size = (size + NBT_ARENA_ALIGN - 1) & ~(size_t)(NBT_ARENA_ALIGN - 1);
+
+	if (size > arena->left)
+	{
+		/* big payloads get their own block, so as not to waste the rest of the current one */
+		if (size > NBT_ARENA_BLOCK/4)
+			return arena_own(arena, g_malloc(size));
+
+		arena->next = arena_own(arena, g_malloc(NBT_ARENA_BLOCK));
+		arena->left = NBT_ARENA_BLOCK;
+	}
+
+	void *p = arena->next;
+	arena->next += size;
+	arena->left -= size;
+	return p;
+}
+
+static void *arena_memdup(struct nbt_arena *arena, const void *data, size_t len)
+{
+	void *p = arena_alloc(arena, len);
+	memcpy(p, data, len);
+	return p;
+}
+
 /* in-memory NBT structure handling */
 
-static struct nbt_tag *nbt_new(char *name, enum nbt_tag_type type)
+static void nbt_struct_init(struct nbt_tag *tag)
+{
+	tag->data.structv.first = 0;
+	tag->data.structv.last = 0;
+	tag->data.structv.count = 0;
+	tag->data.structv.index_size = 0;
+	tag->data.structv.index = 0;
+}
+
+static struct nbt_tag *nbt_new(struct nbt_arena *arena, char *name, size_t namelen, enum nbt_tag_type type)
 {
-	struct nbt_tag *tag = g_new(struct nbt_tag, 1);
+	struct nbt_tag *tag = arena_alloc(arena, sizeof *tag);
 
 	tag->type = type;
+	tag->arena = arena;
 	tag->name = name;
+	tag->next = 0;
 
-	size_t namelen = strlen(name);
 	tag->namelen[0] = namelen >> 8;
 	tag->namelen[1] = namelen;
 
 	return tag;
 }
 
-struct nbt_tag *nbt_new_int(char *name, enum nbt_tag_type type, jint intv)
+static struct nbt_tag *nbt_new_named(struct nbt_arena *arena, const char *name, enum nbt_tag_type type)
+{
+	size_t namelen = strlen(name);
+	return nbt_new(arena, arena_memdup(arena, name, namelen + 1), namelen, type);
+}
+
+struct nbt_tag *nbt_arena_int(struct nbt_arena *arena, const char *name, enum nbt_tag_type type, jint intv)
 {
 	if (type != NBT_TAG_BYTE && type != NBT_TAG_SHORT && type != NBT_TAG_INT)
 		dief("nbt_new_int: bad type: %d", type);
 
-	struct nbt_tag *tag = nbt_new(g_strdup(name), type);
+	struct nbt_tag *tag = nbt_new_named(arena, name, type);
 	tag->data.intv = intv;
 	return tag;
 }
 
-struct nbt_tag *nbt_new_long(char *name, jlong longv)
+struct nbt_tag *nbt_arena_long(struct nbt_arena *arena, const char *name, jlong longv)
 {
-	struct nbt_tag *tag = nbt_new(g_strdup(name), NBT_TAG_LONG);
+	struct nbt_tag *tag = nbt_new_named(arena, name, NBT_TAG_LONG);
 	tag->data.longv = longv;
 	return tag;
 }
 
-struct nbt_tag *nbt_new_double(char *name, enum nbt_tag_type type, double doublev)
+struct nbt_tag *nbt_arena_double(struct nbt_arena *arena, const char *name, enum nbt_tag_type type, double doublev)
 {
 	if (type != NBT_TAG_FLOAT && type != NBT_TAG_DOUBLE)
 		dief("nbt_new_double: bad type: %d", type);
 
-	struct nbt_tag *tag = nbt_new(g_strdup(name), type);
+	struct nbt_tag *tag = nbt_new_named(arena, name, type);
 	tag->data.doublev = doublev;
 	return tag;
 }
 
-struct nbt_tag *nbt_new_blob(char *name, enum nbt_tag_type type, const void *data, size_t len)
+struct nbt_tag *nbt_arena_blob(struct nbt_arena *arena, const char *name, enum nbt_tag_type type, const void *data, size_t len)
 {
 	if (type != NBT_TAG_BLOB && type != NBT_TAG_STR)
 		dief("nbt_new_blob: bad type: %d", type);
 
-	struct nbt_tag *tag = nbt_new(g_strdup(name), type);
+	struct nbt_tag *tag = nbt_new_named(arena, name, type);
 	tag->data.blobv.len = len;
-	tag->data.blobv.data = g_memdup(data, len);
+	tag->data.blobv.data = arena_memdup(arena, data, len);
 	return tag;
 }
 
-struct nbt_tag *nbt_new_str(char *name, const char *str)
+struct nbt_tag *nbt_arena_str(struct nbt_arena *arena, const char *name, const char *str)
 {
-	return nbt_new_blob(name, NBT_TAG_STR, str, strlen(str));
+	return nbt_arena_blob(arena, name, NBT_TAG_STR, str, strlen(str));
 }
 
-struct nbt_tag *nbt_new_struct(char *name)
+struct nbt_tag *nbt_arena_struct(struct nbt_arena *arena, const char *name)
 {
-	struct nbt_tag *tag = nbt_new(g_strdup(name), NBT_TAG_STRUCT);
-	tag->data.structv = g_ptr_array_new_with_free_func(nbt_free);
+	struct nbt_tag *tag = nbt_new_named(arena, name, NBT_TAG_STRUCT);
+	nbt_struct_init(tag);
 	return tag;
 }
 
-void nbt_free(gpointer tag)
+/* lists hold elements of one type: numeric ones as a native array of
+   their values, the others as an array of unnamed tags */
+
+static bool list_numeric(enum nbt_tag_type type)
 {
-	struct nbt_tag *t = tag;
+	return type >= NBT_TAG_BYTE && type <= NBT_TAG_DOUBLE;
+}
 
-	switch (t->type)
+/* int and long arrays are numeric lists under another tag type */
+
+static bool nbt_is_array(enum nbt_tag_type type)
+{
+	return type == NBT_TAG_INT_ARRAY || type == NBT_TAG_LONG_ARRAY;
+}
+
+static enum nbt_tag_type array_type(enum nbt_tag_type type)
+{
+	return type == NBT_TAG_INT_ARRAY ? NBT_TAG_INT : NBT_TAG_LONG;
+}
+
+static bool is_list(struct nbt_tag *t)
+{
+	return t->type == NBT_TAG_ARRAY || nbt_is_array(t->type);
+}
+
+static void nbt_value_init(struct nbt_tag *tag)
+{
+	switch (tag->type)
 	{
 	case NBT_TAG_BLOB:
 	case NBT_TAG_STR:
-		g_free(t->data.blobv.data);
+		tag->data.blobv = (struct buffer){ 0 };
+		break;
+
+	case NBT_TAG_ARRAY:
+		tag->data.listv.type = NBT_TAG_END;
+		tag->data.listv.count = 0;
+		tag->data.listv.items = 0;
+		break;
+
+	case NBT_TAG_INT_ARRAY:
+	case NBT_TAG_LONG_ARRAY:
+		tag->data.listv.type = array_type(tag->type);
+		tag->data.listv.count = 0;
+		tag->data.listv.items = 0;
 		break;
 
 	case NBT_TAG_STRUCT:
-		g_ptr_array_unref(t->data.structv);
+		nbt_struct_init(tag);
 		break;
 
 	default:
-		/* no special actions */
+		tag->data.longv = 0;
 		break;
 	}
-
-	g_free(tag);
-}
-
-struct buffer nbt_blob(struct nbt_tag *s)
-{
-	if (s->type != NBT_TAG_BLOB && s->type != NBT_TAG_STR)
-		dief("nbt_blob: not a blob or a string: %d", s->type);
-
-	return s->data.blobv;
 }
 
-struct nbt_tag *nbt_struct_field(struct nbt_tag *s, const char *name)
+static void list_init(struct nbt_arena *arena, struct nbt_tag *list, enum nbt_tag_type type, unsigned count)
 {
-	if (s->type != NBT_TAG_STRUCT)
-		dief("nbt_struct_field: not a structure: %d", s->type);
-
-	size_t namelen = strlen(name);
-
-	for (unsigned i = 0; i < s->data.structv->len; i++)
+	size_t size;
+
+	if (list_numeric(type))
+		size = nbt_fixed_size[type];
+	else if (type == NBT_TAG_BLOB || type == NBT_TAG_STR || type == NBT_TAG_ARRAY || type == NBT_TAG_STRUCT || nbt_is_array(type))
+		size = sizeof (struct nbt_tag);
+	else if (type == NBT_TAG_END && count == 0)
+		size = 0;
+	else
+		dief("nbt list: bad element type: %d", type);
+
+	list->data.listv.type = type;
+	list->data.listv.count = count;
+	list->data.listv.items = count ? arena_alloc(arena, count * size) : 0;
+
+	if (list_numeric(type))
 	{
-		struct nbt_tag *field = g_ptr_array_index(s->data.structv, i);
-		size_t field_namelen = (field->namelen[0] << 8) | field->namelen[1];
+		if (count)
+			memset(list->data.listv.items, 0, count * size);
+		return;
+	}
 
-		if (field_namelen != namelen)
-			continue;
-		if (memcmp(field->name, name, namelen) != 0)
-			continue;
+	struct nbt_tag *items = list->data.listv.items;
 
-		return field;
+	for (unsigned i = 0; i < count; i++)
+	{
+		items[i].type = type;
+		items[i].arena = arena;
+		items[i].namelen[0] = items[i].namelen[1] = 0;
+		items[i].name = "";
+		items[i].next = 0;
+		nbt_value_init(&items[i]);
 	}
-
-	return 0;
 }
 
-void nbt_struct_add(struct nbt_tag *s, struct nbt_tag *field)
+/* bulk conversion between the big-endian values in documents and
+   native arrays; swapping the bytes is its own inverse, so the same
+   kernels serve both ways, and take unaligned pointers on either side */
+
+static void swap32(void *dst, const void *src, size_t count)
 {
-	if (s->type != NBT_TAG_STRUCT)
-		dief("nbt_struct_add: not a structure: %d", s->type);
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+	memcpy(dst, src, count * 4);
+#else
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t i = 0;
+
+#if defined(__SSSE3__)
+	const __m128i order = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + 4*i));
+		_mm_storeu_si128((__m128i *) (d + 4*i), _mm_shuffle_epi8(v, order));
+	}
+#elif defined(__SSE2__)
+	/* the bytes of each 16-bit half, then the halves */
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + 4*i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+		_mm_storeu_si128((__m128i *) (d + 4*i), v);
+	}
+#endif
 
-	g_ptr_array_add(s->data.structv, field);
+	for (; i < count; i++)
+	{
+		guint32 v;
+		memcpy(&v, s + 4*i, 4);
+		v = GUINT32_SWAP_LE_BE(v);
+		memcpy(d + 4*i, &v, 4);
+	}
+#endif
 }
 
-/* NBT serialization code */
-
-static void format_tag(GByteArray *arr, struct nbt_tag *tag, bool only_payload)
+static void swap64(void *dst, const void *src, size_t count)
 {
-	if (!only_payload)
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+	memcpy(dst, src, count * 8);
+#else
+	uint8_t *d = dst;
+	const uint8_t *s = src;
+	size_t i = 0;
+
+#if defined(__SSSE3__)
+	const __m128i order = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+	for (; i + 2 <= count; i += 2)
 	{
-		unsigned at = arr->len;
-		size_t nlen = strlen(tag->name);
-
-		g_byte_array_set_size(arr, at + 3 + nlen);
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + 8*i));
+		_mm_storeu_si128((__m128i *) (d + 8*i), _mm_shuffle_epi8(v, order));
+	}
+#elif defined(__SSE2__)
+	/* the bytes of each 16-bit quarter, then the quarters */
+	for (; i + 2 <= count; i += 2)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *) (s + 8*i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+		v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+		_mm_storeu_si128((__m128i *) (d + 8*i), v);
+	}
+#endif
 
-		arr->data[at] = tag->type;
-		arr->data[at+1] = tag->namelen[0];
-		arr->data[at+2] = tag->namelen[1];
-		memcpy(&arr->data[at+3], tag->name, nlen);
+	for (; i < count; i++)
+	{
+		guint64 v;
+		memcpy(&v, s + 8*i, 8);
+		v = GUINT64_SWAP_LE_BE(v);
+		memcpy(d + 8*i, &v, 8);
 	}
+#endif
+}
 
-	unsigned at = arr->len;
+/* numeric list values and array contents from the document */
+static void values_read(void *items, enum nbt_tag_type type, unsigned char *p, unsigned count)
+{
+	if (!count)
+		return; /* items may be 0 */
 
-	switch (tag->type)
+	switch (type)
 	{
-	case NBT_TAG_END:
-		/* no payload */
-		break;
-
 	case NBT_TAG_BYTE:
-		g_byte_array_set_size(arr, at + 1);
-		arr->data[at] = tag->data.intv;
+		memcpy(items, p, count);
 		break;
 
 	case NBT_TAG_SHORT:
-		g_byte_array_set_size(arr, at + 2);
-		jshort_write(arr->data + at, tag->data.intv);
+		for (unsigned i = 0; i < count; i++)
+			((jshort *) items)[i] = jshort_read(p + 2*i);
 		break;
 
 	case NBT_TAG_INT:
-		g_byte_array_set_size(arr, at + 4);
-		jint_write(arr->data + at, tag->data.intv);
+		swap32(items, p, count);
 		break;
 
 	case NBT_TAG_LONG:
-		g_byte_array_set_size(arr, at + 8);
-		jlong_write(arr->data + at, tag->data.longv);
+		swap64(items, p, count);
 		break;
 
 	case NBT_TAG_FLOAT:
-		g_byte_array_set_size(arr, at + 4);
-		jfloat_write(arr->data + at, tag->data.doublev);
+#ifndef FEAT_PORTABLE_FLOATS
+		swap32(items, p, count);
+#else
+		for (unsigned i = 0; i < count; i++)
+			((jfloat *) items)[i] = jfloat_read(p + 4*i);
+#endif
 		break;
 
 	case NBT_TAG_DOUBLE:
-		g_byte_array_set_size(arr, at + 8);
-		jdouble_write(arr->data + at, tag->data.doublev);
+#ifndef FEAT_PORTABLE_FLOATS
+		swap64(items, p, count);
+#else
+		for (unsigned i = 0; i < count; i++)
+			((jdouble *) items)[i] = jdouble_read(p + 8*i);
+#endif
 		break;
 
-	case NBT_TAG_BLOB:
-		g_byte_array_set_size(arr, at + 4 + tag->data.blobv.len);
-		jint_write(arr->data + at, tag->data.blobv.len);
-		memcpy(&arr->data[at+4], tag->data.blobv.data, tag->data.blobv.len);
-		break;
-
-	case NBT_TAG_STR:
-		g_byte_array_set_size(arr, at + 2 + tag->data.blobv.len);
-		jshort_write(arr->data + at, tag->data.blobv.len);
-		memcpy(&arr->data[at+2], tag->data.blobv.data, tag->data.blobv.len);
-		break;
-
-	case NBT_TAG_ARRAY:
-		die("nbt format_tag: NBT_TAG_ARRAY unimplemented");
-
-	case NBT_TAG_STRUCT:
-		for (unsigned i = 0; i < tag->data.structv->len; i++)
-			format_tag(arr, g_ptr_array_index(tag->data.structv, i), 0);
-		g_byte_array_append(arr, (uint8_t *) "", 1);
-		break;
+	default:
+		dief("nbt values_read: not a numeric type: %d", type);
 	}
 }
 
-struct buffer nbt_compress(struct nbt_tag *tag)
-{
-	GByteArray *arr = g_byte_array_new();
-
-	g_byte_array_append(arr, (uint8_t *) "\x0a\x00", 3);
-	format_tag(arr, tag, 0);
-
-	uLongf clen = compressBound(arr->len);
-	Bytef *cbuf = g_malloc(clen);
-	int ret = compress(cbuf, &clen, arr->data, arr->len);
-
-	g_byte_array_unref(arr);
-
-	if (ret != Z_OK)
-		dief("zlib broke badly: %s", zError(ret));
-
-	return (struct buffer){ clen, cbuf };
-}
-
-static struct nbt_tag *parse_tag(uint8_t *data, size_t len, size_t *taglen)
+static void values_write(unsigned char *p, enum nbt_tag_type type, void *items, unsigned count)
 {
-	if (len < 1)
-		die("truncated NBT tag: short type");
-
-	uint8_t type = data[0];
-
-	if (type == NBT_TAG_END)
-	{
-		*taglen = 1;
-		return 0;
-	}
-
-	if (len < 3)
-		die("truncated NBT tag: short namelen");
-
-	size_t namelen = jshort_read(&data[1]);
-
-	if (len < 3+namelen)
-		die("truncated NBT tag: short name");
-
-	struct nbt_tag *tag = nbt_new(g_strndup((char*)&data[3], namelen), type);
-
-	data += 3 + namelen;
-	len -= 3 + namelen;
-	*taglen = 3 + namelen;
+	if (!count)
+		return;
 
-	jint t;
-	jbyte tb;
-
-	struct nbt_tag *sub;
-	size_t sublen;
-
-	switch (tag->type)
+	switch (type)
 	{
 	case NBT_TAG_BYTE:
-		if (len < 1) die("truncated NBT tag: short byte");
-		tag->data.intv = (jbyte)*data;
-		*taglen += 1;
+		memcpy(p, items, count);
 		break;
 
 	case NBT_TAG_SHORT:
-		if (len < 2) die("truncated NBT tag: short short");
-		tag->data.intv = jshort_read(data);
-		*taglen += 2;
+		for (unsigned i = 0; i < count; i++)
+			jshort_write(p + 2*i, ((jshort *) items)[i]);
 		break;
 
 	case NBT_TAG_INT:
-		if (len < 4) die("truncated NBT tag: short int");
-		tag->data.intv = jint_read(data);
-		*taglen += 4;
+		swap32(p, items, count);
 		break;
 
 	case NBT_TAG_LONG:
-		if (len < 8) die("truncated NBT tag: short long");
-		tag->data.longv = jlong_read(data);
-		*taglen += 8;
+		swap64(p, items, count);
 		break;
 
 	case NBT_TAG_FLOAT:
-		if (len < 4) die("truncated NBT tag: short float");
-		tag->data.doublev = jfloat_read(data);
-		*taglen += 4;
+#ifndef FEAT_PORTABLE_FLOATS
+		swap32(p, items, count);
+#else
+		for (unsigned i = 0; i < count; i++)
+			jfloat_write(p + 4*i, ((jfloat *) items)[i]);
+#endif
 		break;
 
 	case NBT_TAG_DOUBLE:
-		if (len < 8) die("truncated NBT tag: short double");
-		tag->data.doublev = jdouble_read(data);
-		*taglen += 8;
+#ifndef FEAT_PORTABLE_FLOATS
+		swap64(p, items, count);
+#else
+		for (unsigned i = 0; i < count; i++)
+			jdouble_write(p + 8*i, ((jdouble *) items)[i]);
+#endif
 		break;
 
-	case NBT_TAG_BLOB:
-		if (len < 4) die("truncated NBT tag: short blob len");
-		t = jint_read(data);
-		if (len < 4 + (size_t)t) die("truncated NBT tag: short blob data");
-		tag->data.blobv.len = t;
-		tag->data.blobv.data = g_memdup(&data[4], t);
-		*taglen += 4 + t;
-		break;
+	default:
+		dief("nbt values_write: not a numeric type: %d", type);
+	}
+}
+
+struct nbt_tag *nbt_arena_list(struct nbt_arena *arena, const char *name, enum nbt_tag_type type, unsigned count)
+{
+	struct nbt_tag *tag = nbt_new_named(arena, name, NBT_TAG_ARRAY);
+	list_init(arena, tag, type, count);
+	return tag;
+}
+
+struct nbt_tag *nbt_arena_array(struct nbt_arena *arena, const char *name, enum nbt_tag_type type, unsigned count)
+{
+	if (!nbt_is_array(type))
+		dief("nbt_arena_array: not an array type: %d", type);
+
+	struct nbt_tag *tag = nbt_new_named(arena, name, type);
+	list_init(arena, tag, array_type(type), count);
+	return tag;
+}
+
+struct nbt_tag *nbt_new_int(char *name, enum nbt_tag_type type, jint intv)
+{
+	return nbt_arena_int(0, name, type, intv);
+}
+
+struct nbt_tag *nbt_new_long(char *name, jlong longv)
+{
+	return nbt_arena_long(0, name, longv);
+}
+
+struct nbt_tag *nbt_new_double(char *name, enum nbt_tag_type type, double doublev)
+{
+	return nbt_arena_double(0, name, type, doublev);
+}
+
+struct nbt_tag *nbt_new_blob(char *name, enum nbt_tag_type type, const void *data, size_t len)
+{
+	return nbt_arena_blob(0, name, type, data, len);
+}
+
+struct nbt_tag *nbt_new_str(char *name, const char *str)
+{
+	return nbt_arena_str(0, name, str);
+}
+
+struct nbt_tag *nbt_new_struct(char *name)
+{
+	return nbt_arena_struct(0, name);
+}
+
+struct nbt_tag *nbt_new_list(char *name, enum nbt_tag_type type, unsigned count)
+{
+	return nbt_arena_list(0, name, type, count);
+}
+
+struct nbt_tag *nbt_new_array(char *name, enum nbt_tag_type type, unsigned count)
+{
+	return nbt_arena_array(0, name, type, count);
+}
 
+static void free_payload(struct nbt_tag *t)
+{
+	switch (t->type)
+	{
+	case NBT_TAG_BLOB:
 	case NBT_TAG_STR:
-		if (len < 2) die("truncated NBT tag: short str len");
-		t = jshort_read(data);
-		if (len < 2 + (size_t)t) die("truncated NBT tag: short str data");
-		tag->data.blobv.len = t;
-		tag->data.blobv.data = g_memdup(&data[2], t);
-		*taglen += 2 + t;
+		g_free(t->data.blobv.data);
 		break;
 
 	case NBT_TAG_ARRAY:
-		tag->data.structv = g_ptr_array_new_with_free_func(nbt_free);
-		tb = data[0]; /* type tag byte for the elements */
-		t = jint_read(data + 1);
-		data += 5; len -= 5; *taglen += 5;
-		for (jint i = 0; i < t; i++)
+		if (!list_numeric(t->data.listv.type))
 		{
-			char old[3] = { data[-3], data[-2], data[-1] }; /* TODO this is horrible, HORRIBLE */
-			data[-3] = tb; /* fake a NBT tag byte for the recursive call */
-			data[-2] = 0; data[-1] = 0; /* fake an empty name too */
-			if ((sub = parse_tag(data-3, len+3, &sublen)) == 0)
-				die ("bad NBT tag: failed parsing an array element");
-			g_ptr_array_add(tag->data.structv, sub);
-			memcpy(&data[-3], old, 3); /* restore the clobbered bytes */
-			data += sublen - 3;
-			len -= sublen - 3;
-			*taglen += sublen - 3;
+			struct nbt_tag *items = t->data.listv.items;
+			for (unsigned i = 0; i < t->data.listv.count; i++)
+				free_payload(&items[i]);
 		}
+		g_free(t->data.listv.items);
+		break;
+
+	case NBT_TAG_INT_ARRAY:
+	case NBT_TAG_LONG_ARRAY:
+		g_free(t->data.listv.items);
 		break;
 
 	case NBT_TAG_STRUCT:
-		tag->data.structv = g_ptr_array_new_with_free_func(nbt_free);
-		while ((sub = parse_tag(data, len, &sublen)) != 0)
+		for (struct nbt_tag *sub = t->data.structv.first, *next; sub; sub = next)
 		{
-			nbt_struct_add(tag, sub);
-			data += sublen;
-			len -= sublen;
-			*taglen += sublen;
+			next = sub->next;
+			nbt_free(sub);
 		}
-		*taglen += 1;
+		g_free(t->data.structv.index);
 		break;
 
 	default:
-		dief("nbt parse_tag: unknown tag type: %d", tag->type);
+		/* no special actions */
+		break;
 	}
+}
 
-	return tag;
+void nbt_free(gpointer tag)
+{
+	struct nbt_tag *t = tag;
+
+	if (t->arena)
+	{
+		/* the rest of the tree goes with the arena */
+		if (t->arena->root == t)
+			nbt_arena_free(t->arena);
+		return;
+	}
+
+	free_payload(t);
+	g_free(t->name);
+	g_free(tag);
 }
 
-struct nbt_tag *nbt_uncompress(struct buffer buf)
+enum nbt_tag_type nbt_list_type(struct nbt_tag *l)
 {
-	GByteArray *arr = g_byte_array_new();
+	if (!is_list(l))
+		dief("nbt_list_type: not a list: %d", l->type);
 
-	z_stream zs;
-	zs.next_in = buf.data;
-	zs.avail_in = buf.len;
-	zs.zalloc = Z_NULL;
-	zs.zfree = Z_NULL;
-	zs.opaque = Z_NULL;
+	return l->data.listv.type;
+}
 
-	int ret = inflateInit(&zs);
-	if (ret != Z_OK)
-		dief("zlib broke: inflateInit: %s", zError(ret));
+unsigned nbt_list_len(struct nbt_tag *l)
+{
+	if (!is_list(l))
+		dief("nbt_list_len: not a list: %d", l->type);
 
-	unsigned char zbuf[4096];
+	return l->data.listv.count;
+}
 
-	while (1)
-	{
-		zs.next_out = zbuf;
-		zs.avail_out = sizeof zbuf;
-		int ret = inflate(&zs, Z_NO_FLUSH);
+void *nbt_list_values(struct nbt_tag *l)
+{
+	if (!is_list(l) || !list_numeric(l->data.listv.type))
+		dief("nbt_list_values: not a numeric list: %d", l->type);
 
-		if (ret != Z_OK && ret != Z_STREAM_END)
-			dief("zlib broke: inflate: %s", zError(ret));
+	return l->data.listv.items;
+}
 
-		if (zs.next_out != zbuf)
-			g_byte_array_append(arr, zbuf, zs.next_out - zbuf);
+struct nbt_tag *nbt_list_item(struct nbt_tag *l, unsigned i)
+{
+	if (l->type != NBT_TAG_ARRAY || list_numeric(l->data.listv.type))
+		dief("nbt_list_item: not a list of tags: %d", l->type);
+	if (i >= l->data.listv.count)
+		dief("nbt_list_item: index out of range: %u", i);
 
-		if (ret == Z_STREAM_END)
-			break;
-	}
+	return &((struct nbt_tag *) l->data.listv.items)[i];
+}
+
+struct buffer nbt_blob(struct nbt_tag *s)
+{
+	if (s->type != NBT_TAG_BLOB && s->type != NBT_TAG_STR)
+		dief("nbt_blob: not a blob or a string: %d", s->type);
 
-	inflateEnd(&zs);
+	return s->data.blobv;
+}
 
-	if (arr->len < 3 || memcmp(arr->data, "\x0a\x00", 3) != 0)
-		die("nbt_uncompress: invalid header in uncompressed NBT");
+/* structures with many fields get an open-addressed hash index of the
+   field names, built as the fields are added so that lookups never
+   modify the tree; like the linear scan, it finds the first field of
+   a name */
 
-	size_t t;
-	struct nbt_tag *tag = parse_tag(arr->data + 3, arr->len - 3, &t);
+#define NBT_INDEX_MIN 16 /* fields before a structure is worth indexing */
 
-	g_byte_array_unref(arr);
-	return tag;
+static size_t field_namelen(struct nbt_tag *field)
+{
+	return (field->namelen[0] << 8) | field->namelen[1];
 }
+
+static unsigned field_hash(const char *name, size_t namelen)
+{
+	uint32_t h = 2166136261u; /* FNV-1a */
+	for (size_t i = 0; i < namelen; i++)
+		h = (h ^ (unsigned char)name[i]) * 16777619u;
+	return h;
+}
+
+static struct nbt_tag **index_slot(struct nbt_tag *s, const char *name, size_t namelen)
+{
+	unsigned mask = s->data.structv.index_size - 1;
+
+	for (unsigned i = field_hash(name, namelen) & mask; ; i = (i + 1) & mask)
+	{
+		struct nbt_tag **slot = &s->data.structv.index[i];
+		if (!*slot)
+			return slot;
+		if (field_namelen(*slot) == namelen && memcmp((*slot)->name, name, namelen) == 0)
+			return slot;
+	}
+}
+
+static void index_insert(struct nbt_tag *s, struct nbt_tag *field)
+{
+	struct nbt_tag **slot = index_slot(s, field->name, field_namelen(field));
+	if (!*slot)
+		*slot = field;
+}
+
+static void index_build(struct nbt_tag *s)
+{
+	unsigned size = NBT_INDEX_MIN * 2;
+	while (size < s->data.structv.count * 2)
+		size *= 2;
+
+	/* an outgrown index in an arena stays there until the arena goes */
+	if (!s->arena)
+		g_free(s->data.structv.index);
+
+	s->data.structv.index = arena_alloc(s->arena, size * sizeof *s->data.structv.index);
+	s->data.structv.index_size = size;
+	memset(s->data.structv.index, 0, size * sizeof *s->data.structv.index);
+
+	for (struct nbt_tag *field = s->data.structv.first; field; field = field->next)
+		index_insert(s, field);
+}
+
+struct nbt_tag *nbt_struct_field(struct nbt_tag *s, const char *name)
+{
+	if (s->type != NBT_TAG_STRUCT)
+		dief("nbt_struct_field: not a structure: %d", s->type);
+
+	size_t namelen = strlen(name);
+
+	if (s->data.structv.index_size)
+		return *index_slot(s, name, namelen);
+
+	for (struct nbt_tag *field = s->data.structv.first; field; field = field->next)
+	{
+		if (field_namelen(field) != namelen)
+			continue;
+		if (memcmp(field->name, name, namelen) != 0)
+			continue;
+
+		return field;
+	}
+
+	return 0;
+}
+
+static void nbt_append(struct nbt_tag *s, struct nbt_tag *sub)
+{
+	sub->next = 0;
+	if (s->data.structv.last)
+		s->data.structv.last->next = sub;
+	else
+		s->data.structv.first = sub;
+	s->data.structv.last = sub;
+	s->data.structv.count++;
+
+	/* start the index once there are enough fields, then keep it up to
+	   date and at most half full */
+	if (!s->data.structv.index_size)
+	{
+		if (s->data.structv.count >= NBT_INDEX_MIN)
+			index_build(s);
+	}
+	else if (s->data.structv.count * 2 > s->data.structv.index_size)
+		index_build(s);
+	else
+		index_insert(s, sub);
+}
+
+void nbt_struct_add(struct nbt_tag *s, struct nbt_tag *field)
+{
+	if (s->type != NBT_TAG_STRUCT)
+		dief("nbt_struct_add: not a structure: %d", s->type);
+	if (field->arena != s->arena)
+		die("nbt_struct_add: field from a different arena");
+
+	nbt_append(s, field);
+}
+
+/* NBT serialization code: the exact size of the document is counted
+   first, and the tags are then written out with no reallocation */
+
+static size_t tag_size(struct nbt_tag *tag, bool only_payload)
+{
+	size_t n = only_payload ? 0 : 3 + field_namelen(tag);
+
+	switch (tag->type)
+	{
+	case NBT_TAG_END:
+		/* no payload */
+		break;
+
+	case NBT_TAG_BYTE:
+	case NBT_TAG_SHORT:
+	case NBT_TAG_INT:
+	case NBT_TAG_LONG:
+	case NBT_TAG_FLOAT:
+	case NBT_TAG_DOUBLE:
+		n += nbt_fixed_size[tag->type];
+		break;
+
+	case NBT_TAG_BLOB:
+		n += 4 + tag->data.blobv.len;
+		break;
+
+	case NBT_TAG_STR:
+		n += 2 + tag->data.blobv.len;
+		break;
+
+	case NBT_TAG_ARRAY:
+		n += 5;
+		if (list_numeric(tag->data.listv.type))
+			n += tag->data.listv.count * nbt_fixed_size[tag->data.listv.type];
+		else
+		{
+			struct nbt_tag *items = tag->data.listv.items;
+			for (unsigned i = 0; i < tag->data.listv.count; i++)
+				n += tag_size(&items[i], true);
+		}
+		break;
+
+	case NBT_TAG_INT_ARRAY:
+	case NBT_TAG_LONG_ARRAY:
+		n += 4 + tag->data.listv.count * nbt_fixed_size[tag->data.listv.type];
+		break;
+
+	case NBT_TAG_STRUCT:
+		for (struct nbt_tag *sub = tag->data.structv.first; sub; sub = sub->next)
+			n += tag_size(sub, false);
+		n += 1;
+		break;
+	}
+
+	return n;
+}
+
+/* returns the end of what was written */
+static uint8_t *format_tag(uint8_t *p, struct nbt_tag *tag, bool only_payload)
+{
+	if (!only_payload)
+	{
+		size_t nlen = field_namelen(tag);
+
+		p[0] = tag->type;
+		p[1] = tag->namelen[0];
+		p[2] = tag->namelen[1];
+		memcpy(p + 3, tag->name, nlen);
+		p += 3 + nlen;
+	}
+
+	switch (tag->type)
+	{
+	case NBT_TAG_END:
+		/* no payload */
+		break;
+
+	case NBT_TAG_BYTE:
+		*p++ = tag->data.intv;
+		break;
+
+	case NBT_TAG_SHORT:
+		jshort_write(p, tag->data.intv);
+		p += 2;
+		break;
+
+	case NBT_TAG_INT:
+		jint_write(p, tag->data.intv);
+		p += 4;
+		break;
+
+	case NBT_TAG_LONG:
+		jlong_write(p, tag->data.longv);
+		p += 8;
+		break;
+
+	case NBT_TAG_FLOAT:
+		jfloat_write(p, tag->data.doublev);
+		p += 4;
+		break;
+
+	case NBT_TAG_DOUBLE:
+		jdouble_write(p, tag->data.doublev);
+		p += 8;
+		break;
+
+	case NBT_TAG_BLOB:
+		jint_write(p, tag->data.blobv.len);
+		memcpy(p + 4, tag->data.blobv.data, tag->data.blobv.len);
+		p += 4 + tag->data.blobv.len;
+		break;
+
+	case NBT_TAG_STR:
+		jshort_write(p, tag->data.blobv.len);
+		memcpy(p + 2, tag->data.blobv.data, tag->data.blobv.len);
+		p += 2 + tag->data.blobv.len;
+		break;
+
+	case NBT_TAG_ARRAY:
+		p[0] = tag->data.listv.type;
+		jint_write(p + 1, tag->data.listv.count);
+		p += 5;
+		if (list_numeric(tag->data.listv.type))
+		{
+			values_write(p, tag->data.listv.type, tag->data.listv.items, tag->data.listv.count);
+			p += tag->data.listv.count * nbt_fixed_size[tag->data.listv.type];
+		}
+		else
+		{
+			struct nbt_tag *items = tag->data.listv.items;
+			for (unsigned i = 0; i < tag->data.listv.count; i++)
+				p = format_tag(p, &items[i], true);
+		}
+		break;
+
+	case NBT_TAG_INT_ARRAY:
+	case NBT_TAG_LONG_ARRAY:
+		jint_write(p, tag->data.listv.count);
+		values_write(p + 4, tag->data.listv.type, tag->data.listv.items, tag->data.listv.count);
+		p += 4 + tag->data.listv.count * nbt_fixed_size[tag->data.listv.type];
+		break;
+
+	case NBT_TAG_STRUCT:
+		for (struct nbt_tag *sub = tag->data.structv.first; sub; sub = sub->next)
+			p = format_tag(p, sub, false);
+		*p++ = NBT_TAG_END;
+		break;
+	}
+
+	return p;
+}
+
+size_t nbt_size(struct nbt_tag *tag)
+{
+	/* the unnamed root structure around the tag */
+	return 3 + tag_size(tag, false) + 1;
+}
+
+static void format_doc(struct nbt_tag *tag, uint8_t *out)
+{
+	memcpy(out, "\x0a\x00\x00", 3);
+	uint8_t *end = format_tag(out + 3, tag, false);
+	*end = NBT_TAG_END;
+}
+
+bool nbt_serialize_into(struct nbt_tag *tag, void *out, size_t cap, size_t *len)
+{
+	*len = nbt_size(tag);
+	if (*len > cap)
+		return false;
+
+	format_doc(tag, out);
+	return true;
+}
+
+struct buffer nbt_serialize(struct nbt_tag *tag)
+{
+	struct buffer doc = { .len = nbt_size(tag) };
+	doc.data = g_malloc(doc.len);
+	format_doc(tag, doc.data);
+	return doc;
+}
+
+/* compression: like inflation, every thread keeps its z_stream around,
+   and also the buffer for the uncompressed document and the one for
+   nbt_compress_temp, which only grow */
+
+struct nbt_deflater
+{
+	z_stream zs;
+	uint8_t *raw;
+	size_t rawcap;
+	uint8_t *out;
+	size_t outcap;
+};
+
+static GStaticPrivate deflater_key = G_STATIC_PRIVATE_INIT;
+
+static void deflater_free(gpointer p)
+{
+	struct nbt_deflater *def = p;
+	deflateEnd(&def->zs);
+	g_free(def->raw);
+	g_free(def->out);
+	g_free(def);
+}
+
+/* serializes the tag into the raw buffer, and readies the stream for it */
+static struct nbt_deflater *deflater_start(struct nbt_tag *tag)
+{
+	struct nbt_deflater *def = g_static_private_get(&deflater_key);
+	int ret;
+
+	if (!def)
+	{
+		def = g_new0(struct nbt_deflater, 1);
+		def->zs.zalloc = Z_NULL;
+		def->zs.zfree = Z_NULL;
+		def->zs.opaque = Z_NULL;
+
+		if ((ret = deflateInit(&def->zs, Z_DEFAULT_COMPRESSION)) != Z_OK)
+			dief("zlib broke: deflateInit: %s", zError(ret));
+
+		g_static_private_set(&deflater_key, def, deflater_free);
+	}
+	else if ((ret = deflateReset(&def->zs)) != Z_OK)
+		dief("zlib broke: deflateReset: %s", zError(ret));
+
+	size_t len = nbt_size(tag);
+	if (len > def->rawcap)
+	{
+		g_free(def->raw);
+		def->rawcap = len + len/16;
+		def->raw = g_malloc(def->rawcap);
+	}
+
+	format_doc(tag, def->raw);
+	def->zs.next_in = def->raw;
+	def->zs.avail_in = len;
+	return def;
+}
+
+/* deflates the whole raw buffer; out has room for deflateBound */
+static size_t deflater_run(struct nbt_deflater *def, uint8_t *out, size_t cap)
+{
+	def->zs.next_out = out;
+	def->zs.avail_out = cap;
+
+	int ret = deflate(&def->zs, Z_FINISH);
+	if (ret != Z_STREAM_END)
+		dief("zlib broke badly: deflate: %s", zError(ret));
+
+	return cap - def->zs.avail_out;
+}
+
+struct buffer nbt_compress(struct nbt_tag *tag)
+{
+	struct nbt_deflater *def = deflater_start(tag);
+
+	size_t cap = deflateBound(&def->zs, def->zs.avail_in);
+	struct buffer buf = { .data = g_malloc(cap) };
+	buf.len = deflater_run(def, buf.data, cap);
+	return buf;
+}
+
+struct buffer nbt_compress_temp(struct nbt_tag *tag)
+{
+	struct nbt_deflater *def = deflater_start(tag);
+
+	size_t cap = deflateBound(&def->zs, def->zs.avail_in);
+	if (cap > def->outcap)
+	{
+		g_free(def->out);
+		def->outcap = cap + cap/16;
+		def->out = g_malloc(def->outcap);
+	}
+
+	return (struct buffer){ deflater_run(def, def->out, def->outcap), def->out };
+}
+
+/* streaming NBT serialization: tags are written out as they come, and
+   deflated on the fly; payloads are fed to zlib from where they are */
+
+#define NBT_WRITER_STAGE 256 /* framing bytes collected before deflating */
+#define NBT_WRITER_OUT 16384 /* initial output buffer size */
+
+struct nbt_writer
+{
+	z_stream zs;
+	GByteArray *out; /* len is the capacity, used the part filled */
+	size_t used;
+	unsigned staged;
+	unsigned char stage[NBT_WRITER_STAGE];
+};
+
+static void writer_deflate(struct nbt_writer *w, const void *data, size_t len, int flush)
+{
+	w->zs.next_in = (Bytef *) data;
+	w->zs.avail_in = len;
+
+	int ret;
+
+	do
+	{
+		if (w->used == w->out->len)
+			g_byte_array_set_size(w->out, w->out->len * 2);
+
+		w->zs.next_out = w->out->data + w->used;
+		w->zs.avail_out = w->out->len - w->used;
+
+		ret = deflate(&w->zs, flush);
+		if (ret == Z_STREAM_ERROR)
+			dief("zlib broke badly: deflate: %s", zError(ret));
+
+		w->used = w->out->len - w->zs.avail_out;
+	} while (w->zs.avail_in || (flush == Z_FINISH && ret != Z_STREAM_END));
+}
+
+static void writer_flush(struct nbt_writer *w)
+{
+	if (w->staged)
+		writer_deflate(w, w->stage, w->staged, Z_NO_FLUSH);
+	w->staged = 0;
+}
+
+static void writer_put(struct nbt_writer *w, const void *data, size_t len)
+{
+	if (w->staged + len > sizeof w->stage)
+		writer_flush(w);
+
+	if (len >= sizeof w->stage)
+		writer_deflate(w, data, len, Z_NO_FLUSH);
+	else
+	{
+		memcpy(w->stage + w->staged, data, len);
+		w->staged += len;
+	}
+}
+
+static void writer_header(struct nbt_writer *w, enum nbt_tag_type type, const char *name)
+{
+	size_t namelen = strlen(name);
+	unsigned char hdr[3] = { type, namelen >> 8, namelen };
+
+	writer_put(w, hdr, 3);
+	writer_put(w, name, namelen);
+}
+
+struct nbt_writer *nbt_writer_new(int level)
+{
+	struct nbt_writer *w = g_new(struct nbt_writer, 1);
+
+	w->zs.zalloc = Z_NULL;
+	w->zs.zfree = Z_NULL;
+	w->zs.opaque = Z_NULL;
+
+	int ret = deflateInit(&w->zs, level);
+	if (ret != Z_OK)
+		dief("zlib broke: deflateInit: %s", zError(ret));
+
+	w->out = g_byte_array_sized_new(NBT_WRITER_OUT);
+	g_byte_array_set_size(w->out, NBT_WRITER_OUT);
+	w->used = 0;
+	w->staged = 0;
+
+	/* the unnamed root structure */
+	writer_header(w, NBT_TAG_STRUCT, "");
+
+	return w;
+}
+
+void nbt_write_struct(struct nbt_writer *w, const char *name)
+{
+	writer_header(w, NBT_TAG_STRUCT, name);
+}
+
+void nbt_write_end(struct nbt_writer *w)
+{
+	writer_put(w, "", 1);
+}
+
+void nbt_write_int(struct nbt_writer *w, const char *name, enum nbt_tag_type type, jint intv)
+{
+	unsigned char buf[4];
+	size_t len;
+
+	switch (type)
+	{
+	case NBT_TAG_BYTE:  buf[0] = intv; len = 1; break;
+	case NBT_TAG_SHORT: jshort_write(buf, intv); len = 2; break;
+	case NBT_TAG_INT:   jint_write(buf, intv); len = 4; break;
+	default:
+		dief("nbt_write_int: bad type: %d", type);
+	}
+
+	writer_header(w, type, name);
+	writer_put(w, buf, len);
+}
+
+void nbt_write_long(struct nbt_writer *w, const char *name, jlong longv)
+{
+	unsigned char buf[8];
+	jlong_write(buf, longv);
+
+	writer_header(w, NBT_TAG_LONG, name);
+	writer_put(w, buf, 8);
+}
+
+void nbt_write_blob(struct nbt_writer *w, const char *name, const void *data, size_t len)
+{
+	unsigned char buf[4];
+	jint_write(buf, len);
+
+	writer_header(w, NBT_TAG_BLOB, name);
+	writer_put(w, buf, 4);
+	writer_put(w, data, len);
+}
+
+struct buffer nbt_writer_finish(struct nbt_writer *w, size_t *rawlen)
+{
+	nbt_write_end(w); /* the root structure */
+	writer_flush(w);
+	writer_deflate(w, 0, 0, Z_FINISH);
+	deflateEnd(&w->zs);
+
+	if (rawlen)
+		*rawlen = w->zs.total_in;
+
+	struct buffer buf = { .len = w->used, .data = g_byte_array_free(w->out, false) };
+	g_free(w);
+	return buf;
+}
+
+/* NBT parsing: documents are walked without recursion, keeping a stack
+   of the structures and lists being read, so nesting is only limited by
+   the depth limit; malformed documents fail with an error message */
+
+#define NBT_DEPTH_LIMIT 512 /* default */
+#define NBT_STACK 32 /* frames kept on the C stack before going to the heap */
+
+static unsigned depth_limit = NBT_DEPTH_LIMIT;
+
+void nbt_set_depth_limit(unsigned depth)
+{
+	depth_limit = depth;
+}
+
+static bool stack_push(void **stack, void *local, unsigned *cap, unsigned depth, size_t size, const char **error)
+{
+	if (depth >= depth_limit)
+	{
+		*error = "NBT nesting too deep";
+		return false;
+	}
+
+	if (depth == *cap)
+	{
+		void *bigger = g_malloc(2 * *cap * size);
+		memcpy(bigger, *stack, depth * size);
+		if (*stack != local)
+			g_free(*stack);
+		*stack = bigger;
+		*cap *= 2;
+	}
+
+	return true;
+}
+
+static bool check_header(struct buffer doc, const char **error)
+{
+	if (doc.len < 3 || memcmp(doc.data, "\x0a\x00", 3) != 0)
+	{
+		*error = "invalid header in uncompressed NBT";
+		return false;
+	}
+
+	return true;
+}
+
+static bool list_type_ok(uint8_t type, jint count)
+{
+	return list_numeric(type) || type == NBT_TAG_BLOB || type == NBT_TAG_STR
+		|| type == NBT_TAG_ARRAY || type == NBT_TAG_STRUCT || nbt_is_array(type)
+		|| (type == NBT_TAG_END && count == 0);
+}
+
+#define FAIL(msg) do { *error = (msg); return false; } while (0)
+
+/* the type and name of the next field of a structure; 0 at its end */
+static bool parse_header(struct nbt_arena *arena, uint8_t *data, size_t len, size_t *at, struct nbt_tag **tag, const char **error)
+{
+	if (*at >= len)
+		FAIL("truncated NBT tag: short type");
+
+	uint8_t type = data[*at];
+
+	if (type == NBT_TAG_END)
+	{
+		*at += 1;
+		*tag = 0;
+		return true;
+	}
+
+	if (len - *at < 3)
+		FAIL("truncated NBT tag: short namelen");
+
+	size_t namelen = (uint16_t)jshort_read(&data[*at+1]);
+
+	if (len - *at - 3 < namelen)
+		FAIL("truncated NBT tag: short name");
+
+	*tag = nbt_new(arena, (char *)&data[*at+3], namelen, type);
+	*at += 3 + namelen;
+	return true;
+}
+
+/* the payload of a tag, except for the contents of structures and of
+   lists of tags, which are filled in as the parse goes on */
+static bool parse_value(struct nbt_arena *arena, struct nbt_tag *tag, uint8_t *data, size_t len, size_t *n, const char **error)
+{
+	jint t;
+
+	switch (tag->type)
+	{
+	case NBT_TAG_BYTE:
+		if (len < 1) FAIL("truncated NBT tag: short byte");
+		tag->data.intv = (jbyte)*data;
+		*n = 1;
+		return true;
+
+	case NBT_TAG_SHORT:
+		if (len < 2) FAIL("truncated NBT tag: short short");
+		tag->data.intv = jshort_read(data);
+		*n = 2;
+		return true;
+
+	case NBT_TAG_INT:
+		if (len < 4) FAIL("truncated NBT tag: short int");
+		tag->data.intv = jint_read(data);
+		*n = 4;
+		return true;
+
+	case NBT_TAG_LONG:
+		if (len < 8) FAIL("truncated NBT tag: short long");
+		tag->data.longv = jlong_read(data);
+		*n = 8;
+		return true;
+
+	case NBT_TAG_FLOAT:
+		if (len < 4) FAIL("truncated NBT tag: short float");
+		tag->data.doublev = jfloat_read(data);
+		*n = 4;
+		return true;
+
+	case NBT_TAG_DOUBLE:
+		if (len < 8) FAIL("truncated NBT tag: short double");
+		tag->data.doublev = jdouble_read(data);
+		*n = 8;
+		return true;
+
+	case NBT_TAG_BLOB:
+		if (len < 4) FAIL("truncated NBT tag: short blob len");
+		t = jint_read(data);
+		if (t < 0 || len - 4 < (size_t)t) FAIL("truncated NBT tag: short blob data");
+		tag->data.blobv.len = t;
+		tag->data.blobv.data = &data[4];
+		*n = 4 + t;
+		return true;
+
+	case NBT_TAG_STR:
+		if (len < 2) FAIL("truncated NBT tag: short str len");
+		t = (uint16_t)jshort_read(data);
+		if (len - 2 < (size_t)t) FAIL("truncated NBT tag: short str data");
+		tag->data.blobv.len = t;
+		tag->data.blobv.data = &data[2];
+		*n = 2 + t;
+		return true;
+
+	case NBT_TAG_ARRAY:
+		if (len < 5) FAIL("truncated NBT tag: short list header");
+		t = jint_read(data + 1);
+		/* every element takes at least a byte; bounds the allocation */
+		if (t < 0 || len - 5 < (size_t)t) FAIL("truncated NBT tag: short list data");
+		if (!list_type_ok(data[0], t)) FAIL("bad NBT tag: bad list element type");
+		if (list_numeric(data[0]) && (len - 5) / nbt_fixed_size[data[0]] < (size_t)t)
+			FAIL("truncated NBT tag: short list data");
+		list_init(arena, tag, data[0], t);
+		*n = 5;
+		if (list_numeric(data[0]))
+		{
+			values_read(tag->data.listv.items, data[0], data + 5, t);
+			*n += t * nbt_fixed_size[data[0]];
+		}
+		return true;
+
+	case NBT_TAG_INT_ARRAY:
+	case NBT_TAG_LONG_ARRAY:
+		if (len < 4) FAIL("truncated NBT tag: short array len");
+		t = jint_read(data);
+		if (t < 0 || (len - 4) / nbt_fixed_size[array_type(tag->type)] < (size_t)t)
+			FAIL("truncated NBT tag: short array data");
+		tag->data.listv.type = array_type(tag->type);
+		tag->data.listv.count = t;
+		tag->data.listv.items = t ? arena_alloc(arena, t * nbt_fixed_size[tag->data.listv.type]) : 0;
+		values_read(tag->data.listv.items, tag->data.listv.type, data + 4, t);
+		*n = 4 + t * nbt_fixed_size[tag->data.listv.type];
+		return true;
+
+	case NBT_TAG_STRUCT:
+		nbt_struct_init(tag);
+		*n = 0;
+		return true;
+
+	default:
+		FAIL("bad NBT tag: unknown tag type");
+	}
+}
+
+#undef FAIL
+
+struct parse_frame
+{
+	struct nbt_tag *tag; /* structure or list of tags being filled in */
+	unsigned next; /* list: element to read next */
+};
+
+static struct nbt_tag *parse_doc(struct nbt_arena *arena, struct buffer doc, const char **error)
+{
+	struct parse_frame local[NBT_STACK], *stack = local;
+	unsigned depth = 0, cap = NBT_STACK;
+
+	struct nbt_tag *root, *tag;
+	uint8_t *data = doc.data + 3;
+	size_t len = doc.len - 3, at = 0, n;
+
+	if (!check_header(doc, error) || !parse_header(arena, data, len, &at, &root, error))
+		goto fail;
+	if (!root)
+	{
+		*error = "empty NBT document";
+		goto fail;
+	}
+
+	tag = root;
+
+	while (tag)
+	{
+		if (!parse_value(arena, tag, data + at, len - at, &n, error))
+			goto fail;
+		at += n;
+
+		if (tag->type == NBT_TAG_STRUCT || (tag->type == NBT_TAG_ARRAY && !list_numeric(tag->data.listv.type)))
+		{
+			if (!stack_push((void **) &stack, local, &cap, depth, sizeof *stack, error))
+				goto fail;
+			stack[depth++] = (struct parse_frame){ .tag = tag, .next = 0 };
+		}
+
+		/* the next field of the innermost structure, or element of the
+		   innermost list, that is not done yet */
+
+		tag = 0;
+
+		while (depth && !tag)
+		{
+			struct parse_frame *f = &stack[depth-1];
+
+			if (f->tag->type == NBT_TAG_STRUCT)
+			{
+				if (!parse_header(arena, data, len, &at, &tag, error))
+					goto fail;
+				if (tag)
+					nbt_append(f->tag, tag);
+				else
+					depth--;
+			}
+			else if (f->next < f->tag->data.listv.count)
+				tag = &((struct nbt_tag *) f->tag->data.listv.items)[f->next++];
+			else
+				depth--;
+		}
+	}
+
+	if (stack != local)
+		g_free(stack);
+
+	arena->root = root;
+	return root;
+
+fail:
+	if (stack != local)
+		g_free(stack);
+
+	nbt_arena_free(arena);
+	return 0;
+}
+
+/* inflation: every thread keeps its z_stream around and resets it for
+   each document, which is inflated into a single buffer of the hinted
+   size, only grown when the hint was too small */
+
+#define NBT_INFLATE_HINT 16384 /* until a thread has inflated something */
+
+struct nbt_inflater
+{
+	z_stream zs;
+	size_t last; /* size of the last document inflated by the thread */
+};
+
+static GStaticPrivate inflater_key = G_STATIC_PRIVATE_INIT;
+
+static void inflater_free(gpointer p)
+{
+	struct nbt_inflater *inf = p;
+	inflateEnd(&inf->zs);
+	g_free(inf);
+}
+
+static struct nbt_inflater *inflater_start(struct buffer buf)
+{
+	struct nbt_inflater *inf = g_static_private_get(&inflater_key);
+	int ret;
+
+	if (!inf)
+	{
+		inf = g_new(struct nbt_inflater, 1);
+		inf->zs.next_in = Z_NULL;
+		inf->zs.avail_in = 0;
+		inf->zs.zalloc = Z_NULL;
+		inf->zs.zfree = Z_NULL;
+		inf->zs.opaque = Z_NULL;
+		inf->last = NBT_INFLATE_HINT;
+
+		if ((ret = inflateInit(&inf->zs)) != Z_OK)
+			dief("zlib broke: inflateInit: %s", zError(ret));
+
+		g_static_private_set(&inflater_key, inf, inflater_free);
+	}
+	else if ((ret = inflateReset(&inf->zs)) != Z_OK)
+		dief("zlib broke: inflateReset: %s", zError(ret));
+
+	inf->zs.next_in = buf.data;
+	inf->zs.avail_in = buf.len;
+	return inf;
+}
+
+/* inflates until the output is full or the document ends */
+static bool inflater_run(struct nbt_inflater *inf, uint8_t *out, size_t cap, size_t *n, bool *done, const char **error)
+{
+	inf->zs.next_out = out;
+	inf->zs.avail_out = cap;
+	*done = false;
+
+	do
+	{
+		int ret = inflate(&inf->zs, Z_NO_FLUSH);
+
+		if (ret == Z_STREAM_END)
+		{
+			*done = true;
+			break;
+		}
+
+		if ((ret == Z_BUF_ERROR && inf->zs.avail_out) || (ret != Z_OK && ret != Z_BUF_ERROR))
+		{
+			*error = ret == Z_BUF_ERROR ? "truncated compressed NBT" : zError(ret);
+			return false;
+		}
+	} while (inf->zs.avail_out);
+
+	*n = cap - inf->zs.avail_out;
+	return true;
+}
+
+struct buffer nbt_inflate(struct buffer buf, size_t hint, const char **error)
+{
+	struct nbt_inflater *inf = inflater_start(buf);
+
+	/* documents vary a little around the last size; and one more byte
+	   lets zlib see the end of a document of exactly the hinted size */
+	size_t cap = (hint ? hint : inf->last + inf->last/16) + 1;
+	uint8_t *out = g_malloc(cap);
+	size_t len = 0, n;
+	bool done;
+
+	while (1)
+	{
+		if (!inflater_run(inf, out + len, cap - len, &n, &done, error))
+			goto fail;
+
+		len += n;
+		if (done)
+			break;
+
+		cap *= 2;
+		out = g_realloc(out, cap);
+	}
+
+	inf->last = len;
+
+	struct buffer doc = { len, out };
+	if (!check_header(doc, error))
+		goto fail;
+	return doc;
+
+fail:
+	g_free(out);
+	return (struct buffer){ 0 };
+}
+
+bool nbt_inflate_into(struct buffer buf, void *out, size_t cap, size_t *len, const char **error)
+{
+	struct nbt_inflater *inf = inflater_start(buf);
+	bool done;
+
+	*error = 0;
+
+	if (!inflater_run(inf, out, cap, len, &done, error))
+		return false;
+
+	/* a document exactly filling the buffer has at most its trailer left */
+	if (!done)
+	{
+		uint8_t extra;
+		size_t n;
+		if (!inflater_run(inf, &extra, 1, &n, &done, error) || n || !done)
+			return false;
+	}
+
+	return check_header((struct buffer){ *len, out }, error);
+}
+
+struct nbt_tag *nbt_parse(struct buffer doc, const char **error)
+{
+	return parse_doc(nbt_arena_new(), doc, error);
+}
+
+struct nbt_tag *nbt_uncompress(struct buffer buf, const char **error)
+{
+	struct buffer doc = nbt_inflate(buf, 0, error);
+	if (!doc.data)
+		return 0;
+
+	struct nbt_arena *arena = nbt_arena_new();
+	arena_own(arena, doc.data);
+
+	return parse_doc(arena, doc, error);
+}
+
+/* visiting NBT reader: walks the document in place like the parser,
+   and only reports the tags at the wanted paths; everything else is
+   skipped over without building anything */
+
+#define NBT_SCAN_PATH 256 /* longest path that can be wanted */
+
+struct scan_frame
+{
+	bool list; /* or a structure */
+	bool inside; /* structure: wanted paths go into it */
+	uint8_t type; /* list: of the elements */
+	jint left; /* list: elements not read yet */
+	size_t pathlen; /* structure: of its path */
+	int want; /* the path to report the structure or list for when done, or -1 */
+	size_t start; /* of its payload */
+};
+
+#define FAIL(msg) do { *error = (msg); goto fail; } while (0)
+
+bool nbt_scan(struct buffer doc, const char *const *paths, unsigned npaths, nbt_visit_func *visit, void *data, const char **error)
+{
+	if (!check_header(doc, error))
+		return false;
+
+	struct scan_frame local[NBT_STACK], *stack = local;
+	unsigned depth = 0, cap = NBT_STACK;
+
+	uint8_t *d = doc.data + 3;
+	size_t len = doc.len - 3, at = 0;
+	char path[NBT_SCAN_PATH];
+
+	stack[depth++] = (struct scan_frame){ .list = false, .inside = true, .pathlen = 0, .want = -1 };
+
+	while (depth)
+	{
+		struct scan_frame *f = &stack[depth-1];
+		uint8_t type;
+		int want = -1;
+		bool inside = false;
+		size_t sublen = 0;
+
+		if (f->list ? !f->left : at < len && d[at] == NBT_TAG_END)
+		{
+			/* end of the structure or list */
+			at += f->list ? 0 : 1;
+			if (f->want >= 0)
+				visit(f->want, f->list ? NBT_TAG_ARRAY : NBT_TAG_STRUCT, (struct buffer){ at - f->start, d + f->start }, data);
+			depth--;
+			continue;
+		}
+
+		if (f->list)
+		{
+			f->left--;
+			type = f->type;
+		}
+		else
+		{
+			if (len - at < 3)
+				FAIL("truncated NBT tag: short namelen");
+
+			type = d[at];
+			size_t namelen = (uint16_t)jshort_read(&d[at+1]);
+			char *name = (char *) &d[at+3];
+
+			if (len - at - 3 < namelen)
+				FAIL("truncated NBT tag: short name");
+			at += 3 + namelen;
+
+			/* the path of this tag, unless too long to be wanted */
+			sublen = f->pathlen + (f->pathlen ? 1 : 0) + namelen;
+
+			if (f->inside && sublen < NBT_SCAN_PATH)
+			{
+				if (f->pathlen)
+					path[f->pathlen] = '/';
+				memcpy(&path[sublen - namelen], name, namelen);
+
+				for (unsigned p = 0; p < npaths; p++)
+				{
+					const char *w = paths[p];
+
+					/* names may hold NUL bytes, so no strncmp */
+					if (strlen(w) < sublen || memcmp(w, path, sublen) != 0)
+						continue;
+
+					if (w[sublen] == 0 && want < 0)
+						want = p;
+					else if (w[sublen] == '/' && type == NBT_TAG_STRUCT)
+						inside = true;
+				}
+			}
+		}
+
+		/* the payload */
+
+		size_t start = at, n;
+		jint t;
+
+		switch (type)
+		{
+		case NBT_TAG_BYTE:
+		case NBT_TAG_SHORT:
+		case NBT_TAG_INT:
+		case NBT_TAG_LONG:
+		case NBT_TAG_FLOAT:
+		case NBT_TAG_DOUBLE:
+			n = nbt_fixed_size[type];
+			break;
+
+		case NBT_TAG_BLOB:
+			if (len - at < 4) FAIL("truncated NBT tag: short blob len");
+			t = jint_read(d + at);
+			if (t < 0) FAIL("bad NBT tag: negative blob length");
+			n = 4 + (size_t)t;
+			break;
+
+		case NBT_TAG_STR:
+			if (len - at < 2) FAIL("truncated NBT tag: short str len");
+			n = 2 + (uint16_t)jshort_read(d + at);
+			break;
+
+		case NBT_TAG_INT_ARRAY:
+		case NBT_TAG_LONG_ARRAY:
+			if (len - at < 4) FAIL("truncated NBT tag: short array len");
+			t = jint_read(d + at);
+			if (t < 0 || (len - at - 4) / nbt_fixed_size[array_type(type)] < (size_t)t)
+				FAIL("truncated NBT tag: short array data");
+			n = 4 + t * nbt_fixed_size[array_type(type)];
+			break;
+
+		case NBT_TAG_ARRAY:
+			if (len - at < 5) FAIL("truncated NBT tag: short list header");
+			t = jint_read(d + at + 1);
+			if (t < 0 || !list_type_ok(d[at], t)) FAIL("bad NBT tag: bad list header");
+			n = 5;
+			if (list_numeric(d[at]))
+			{
+				if ((len - at - 5) / nbt_fixed_size[d[at]] < (size_t)t)
+					FAIL("truncated NBT tag: short list data");
+				n += t * nbt_fixed_size[d[at]];
+			}
+			else if (t)
+			{
+				if (!stack_push((void **) &stack, local, &cap, depth, sizeof *stack, error))
+					goto fail;
+				stack[depth++] = (struct scan_frame){ .list = true, .type = d[at], .left = t, .want = want, .start = start };
+				at += 5;
+				continue;
+			}
+			break;
+
+		case NBT_TAG_STRUCT:
+			if (!stack_push((void **) &stack, local, &cap, depth, sizeof *stack, error))
+				goto fail;
+			stack[depth++] = (struct scan_frame){ .list = false, .inside = inside, .pathlen = sublen, .want = want, .start = start };
+			continue;
+
+		default:
+			FAIL("bad NBT tag: unknown tag type");
+		}
+
+		if (len - at < n)
+			FAIL("truncated NBT tag: short payload");
+		at += n;
+
+		if (want >= 0)
+		{
+			struct buffer payload = { n, d + start };
+
+			/* blobs, strings and arrays without their length */
+			if (type == NBT_TAG_BLOB || nbt_is_array(type))
+				ADVANCE_BUFFER(payload, 4);
+			else if (type == NBT_TAG_STR)
+				ADVANCE_BUFFER(payload, 2);
+
+			visit(want, type, payload, data);
+		}
+	}
+
+	if (stack != local)
+		g_free(stack);
+	return true;
+
+fail:
+	if (stack != local)
+		g_free(stack);
+	return false;
+}
+
+#undef FAIL
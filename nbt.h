@@ -13,10 +13,17 @@ enum nbt_tag_type
 	NBT_TAG_BLOB = 7,
 	NBT_TAG_STR = 8,
 	NBT_TAG_ARRAY = 9,
-	NBT_TAG_STRUCT = 10
+	NBT_TAG_STRUCT = 10,
+	NBT_TAG_INT_ARRAY = 11,
+	NBT_TAG_LONG_ARRAY = 12
 };
 
 struct nbt_tag;
+struct nbt_arena;
+
+/* tags made with nbt_new_* are on the heap, and nbt_free releases them
+   one by one; the nbt_arena_* variants allocate from an arena instead,
+   and are only released by nbt_arena_free, all at once */
 
 struct nbt_tag *nbt_new_int(char *name, enum nbt_tag_type type, jint intv);
 struct nbt_tag *nbt_new_long(char *name, jlong longv);
@@ -27,14 +34,105 @@ struct nbt_tag *nbt_new_str(char *name, const char *str);
 
 struct nbt_tag *nbt_new_struct(char *name);
 
+/* lists are made with count empty elements of the given type; numeric
+   elements are set through the native array of nbt_list_values, and
+   the others filled in through nbt_list_item */
+struct nbt_tag *nbt_new_list(char *name, enum nbt_tag_type type, unsigned count);
+
+/* int and long arrays (NBT_TAG_INT_ARRAY, NBT_TAG_LONG_ARRAY) are kept
+   like lists of ints or longs: made with count zeroes, and set through
+   nbt_list_values */
+struct nbt_tag *nbt_new_array(char *name, enum nbt_tag_type type, unsigned count);
+
+struct nbt_arena *nbt_arena_new(void);
+void nbt_arena_free(struct nbt_arena *arena);
+
+struct nbt_tag *nbt_arena_int(struct nbt_arena *arena, const char *name, enum nbt_tag_type type, jint intv);
+struct nbt_tag *nbt_arena_long(struct nbt_arena *arena, const char *name, jlong longv);
+struct nbt_tag *nbt_arena_double(struct nbt_arena *arena, const char *name, enum nbt_tag_type type, double doublev);
+
+struct nbt_tag *nbt_arena_blob(struct nbt_arena *arena, const char *name, enum nbt_tag_type type, const void *data, size_t len);
+struct nbt_tag *nbt_arena_str(struct nbt_arena *arena, const char *name, const char *str);
+
+struct nbt_tag *nbt_arena_struct(struct nbt_arena *arena, const char *name);
+struct nbt_tag *nbt_arena_list(struct nbt_arena *arena, const char *name, enum nbt_tag_type type, unsigned count);
+struct nbt_tag *nbt_arena_array(struct nbt_arena *arena, const char *name, enum nbt_tag_type type, unsigned count);
+
 void nbt_free(gpointer tag);
 
 struct buffer nbt_blob(struct nbt_tag *s);
 
+/* lookups only read the tree, so several threads may share one that
+   nothing adds to any more */
 struct nbt_tag *nbt_struct_field(struct nbt_tag *s, const char *name);
 void nbt_struct_add(struct nbt_tag *s, struct nbt_tag *field);
 
+enum nbt_tag_type nbt_list_type(struct nbt_tag *l);
+unsigned nbt_list_len(struct nbt_tag *l);
+void *nbt_list_values(struct nbt_tag *l); /* jbyte, jshort, jint, jlong, jfloat or jdouble */
+struct nbt_tag *nbt_list_item(struct nbt_tag *l, unsigned i);
+
 struct buffer nbt_compress(struct nbt_tag *tag);
-struct nbt_tag *nbt_uncompress(struct buffer buf);
+struct buffer nbt_serialize(struct nbt_tag *tag); /* uncompressed */
+
+/* the same into a buffer kept by the calling thread, valid until its
+   next call; for data written out or copied right away */
+struct buffer nbt_compress_temp(struct nbt_tag *tag);
+
+/* exact size of the uncompressed document, and serialization into a
+   buffer of the caller; false with *len set to that size if it does
+   not fit */
+size_t nbt_size(struct nbt_tag *tag);
+bool nbt_serialize_into(struct nbt_tag *tag, void *out, size_t cap, size_t *len);
+
+/* reading NBT: malformed documents do not kill the process, but make
+   the functions below fail, with *error set to a static message;
+   structures and lists nested deeper than the depth limit count as
+   malformed */
+
+void nbt_set_depth_limit(unsigned depth);
+
+/* the parsed tree is a view: tag names and blob and string payloads
+   point into the inflated document; the tree and the document are in
+   one arena, which nbt_free on the root releases; 0 on errors */
+struct nbt_tag *nbt_uncompress(struct buffer buf, const char **error);
+
+/* the same for an uncompressed document, which has to outlive the tree */
+struct nbt_tag *nbt_parse(struct buffer doc, const char **error);
+
+/* inflated NBT document, checked to start with the root structure, or
+   an empty buffer on errors; the buffer is allocated with the hinted
+   size, by default the size of the last document inflated by the
+   calling thread, and only grown if that is too small */
+struct buffer nbt_inflate(struct buffer buf, size_t hint, const char **error);
+
+/* the same into a buffer of the caller; false with *error unset if
+   the document does not fit */
+bool nbt_inflate_into(struct buffer buf, void *out, size_t cap, size_t *len, const char **error);
+
+/* visiting reader over an inflated document: calls visit for the tags
+   at the wanted paths, such as "Level/Blocks", relative to the root
+   structure, and skips everything else; the payload is a view into the
+   document, without the length of blobs, strings and arrays, and
+   arrays are as in the document, big-endian; visits made before an
+   error are not taken back */
+
+typedef void nbt_visit_func(unsigned path, enum nbt_tag_type type, struct buffer payload, void *data);
+
+bool nbt_scan(struct buffer doc, const char *const *paths, unsigned npaths, nbt_visit_func *visit, void *data, const char **error);
+
+/* streaming serialization straight to compressed NBT, without a tree;
+   the writer opens the unnamed root structure, and finish closes it;
+   level is a zlib level, 0 only wrapping the data in stored blocks */
+
+struct nbt_writer;
+
+struct nbt_writer *nbt_writer_new(int level);
+void nbt_write_struct(struct nbt_writer *w, const char *name);
+void nbt_write_end(struct nbt_writer *w);
+void nbt_write_int(struct nbt_writer *w, const char *name, enum nbt_tag_type type, jint intv);
+void nbt_write_long(struct nbt_writer *w, const char *name, jlong longv);
+void nbt_write_blob(struct nbt_writer *w, const char *name, const void *data, size_t len);
+struct buffer nbt_writer_finish(struct nbt_writer *w, size_t *rawlen);
 
 #endif /* MCMAP_NBT_H */
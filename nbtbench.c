@@ -0,0 +1,393 @@
+/* NBT benchmark: runs the NBT code over a corpus of chunk documents,
+   either made up or taken from a world directory, and reports the
+   throughput and the allocations per document of each stage */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <glib.h>
+
+#include "config.h"
+#include "types.h"
+#include "platform.h"
+#include "common.h"
+#include "console.h"
+#include "nbt.h"
+#include "protocol.h"
+#include "world.h"
+
+#define BENCH_DOCS 256
+#define BENCH_PASSES 5
+#define BENCH_LOOKUPS 100 /* rounds of field lookups per document */
+
+#define BENCH_ENTITIES 12 /* per made-up chunk */
+#define BENCH_CHESTS 4
+#define BENCH_ITEMS 9 /* per chest */
+
+/* options */
+
+static int ndocs = BENCH_DOCS;
+static int passes = BENCH_PASSES;
+static char *world = 0;
+
+/* allocations are counted by interposing malloc on glibc, as newer
+   glib ignores custom memory vtables, and through the vtable elsewhere */
+
+static guint64 nallocs = 0;
+
+#ifdef __GLIBC__
+
+void *__libc_malloc(size_t n);
+void *__libc_realloc(void *p, size_t n);
+void *__libc_calloc(size_t n, size_t size);
+
+void *malloc(size_t n)
+{
+	nallocs++;
+	return __libc_malloc(n);
+}
+
+void *realloc(void *p, size_t n)
+{
+	nallocs++;
+	return __libc_realloc(p, n);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	nallocs++;
+	return __libc_calloc(n, size);
+}
+
+#define count_vtable_install() /* not needed */
+
+#else /* !__GLIBC__ */
+
+static gpointer count_malloc(gsize n)
+{
+	nallocs++;
+	return malloc(n);
+}
+
+static gpointer count_realloc(gpointer p, gsize n)
+{
+	nallocs++;
+	return realloc(p, n);
+}
+
+static gpointer count_calloc(gsize n, gsize size)
+{
+	nallocs++;
+	return calloc(n, size);
+}
+
+static GMemVTable count_vtable = {
+	.malloc = count_malloc,
+	.realloc = count_realloc,
+	.free = free,
+	.calloc = count_calloc,
+};
+
+#define count_vtable_install() g_mem_set_vtable(&count_vtable)
+
+#endif /* __GLIBC__ */
+
+/* made-up chunks: terrain, a few mobs, and chests full of items */
+
+static void fill_list(struct nbt_tag *list, GRand *rand, double lo, double hi)
+{
+	if (nbt_list_type(list) == NBT_TAG_FLOAT)
+	{
+		jfloat *v = nbt_list_values(list);
+		for (unsigned i = 0; i < nbt_list_len(list); i++)
+			v[i] = g_rand_double_range(rand, lo, hi);
+	}
+	else
+	{
+		jdouble *v = nbt_list_values(list);
+		for (unsigned i = 0; i < nbt_list_len(list); i++)
+			v[i] = g_rand_double_range(rand, lo, hi);
+	}
+}
+
+static struct buffer make_chunk(GRand *rand, jint cx, jint cz)
+{
+	static const char *mobs[] = { "Pig", "Cow", "Sheep", "Chicken", "Zombie", "Item" };
+
+	static unsigned char blocks[CHUNK_NBLOCKS];
+	static unsigned char meta[CHUNK_NBLOCKS/2];
+	static unsigned char light_blocks[CHUNK_NBLOCKS/2];
+	static unsigned char light_sky[CHUNK_NBLOCKS/2];
+	static unsigned char height[CHUNK_XSIZE*CHUNK_ZSIZE];
+
+	memset(meta, 0, sizeof meta);
+	memset(light_blocks, 0, sizeof light_blocks);
+
+	for (int x = 0; x < CHUNK_XSIZE; x++)
+		for (int z = 0; z < CHUNK_ZSIZE; z++)
+		{
+			int col = x*CHUNK_ZSIZE + z;
+			int h = 60 + g_rand_int_range(rand, 0, 8);
+			height[z*CHUNK_XSIZE + x] = h + 1;
+
+			for (int y = 0; y < CHUNK_YSIZE; y++)
+			{
+				unsigned char b = 0;
+				if (y < 3 && g_rand_int_range(rand, 0, 2))
+					b = 7; /* bedrock */
+				else if (y < h - 4)
+					b = g_rand_int_range(rand, 0, 100) ? 1 : 14 + g_rand_int_range(rand, 0, 3); /* stone and ores */
+				else if (y < h)
+					b = 3; /* dirt */
+				else if (y == h)
+					b = 2; /* grass */
+				blocks[col*CHUNK_YSIZE + y] = b;
+			}
+
+			for (int y = 0; y < CHUNK_YSIZE; y += 2)
+				light_sky[(col*CHUNK_YSIZE + y)/2] = (y > h ? 0x0f : 0) | (y+1 > h ? 0xf0 : 0);
+		}
+
+	struct nbt_arena *arena = nbt_arena_new();
+	struct nbt_tag *level = nbt_arena_struct(arena, "Level");
+
+	nbt_struct_add(level, nbt_arena_blob(arena, "Blocks", NBT_TAG_BLOB, blocks, sizeof blocks));
+	nbt_struct_add(level, nbt_arena_blob(arena, "Data", NBT_TAG_BLOB, meta, sizeof meta));
+	nbt_struct_add(level, nbt_arena_blob(arena, "SkyLight", NBT_TAG_BLOB, light_sky, sizeof light_sky));
+	nbt_struct_add(level, nbt_arena_blob(arena, "BlockLight", NBT_TAG_BLOB, light_blocks, sizeof light_blocks));
+	nbt_struct_add(level, nbt_arena_blob(arena, "HeightMap", NBT_TAG_BLOB, height, sizeof height));
+
+	struct nbt_tag *entities = nbt_arena_list(arena, "Entities", NBT_TAG_STRUCT, BENCH_ENTITIES);
+	for (unsigned i = 0; i < BENCH_ENTITIES; i++)
+	{
+		struct nbt_tag *e = nbt_list_item(entities, i);
+		struct nbt_tag *pos = nbt_arena_list(arena, "Pos", NBT_TAG_DOUBLE, 3);
+		struct nbt_tag *motion = nbt_arena_list(arena, "Motion", NBT_TAG_DOUBLE, 3);
+		struct nbt_tag *rotation = nbt_arena_list(arena, "Rotation", NBT_TAG_FLOAT, 2);
+
+		fill_list(pos, rand, cx*CHUNK_XSIZE, (cx+1)*CHUNK_XSIZE);
+		fill_list(motion, rand, -0.1, 0.1);
+		fill_list(rotation, rand, 0, 360);
+
+		nbt_struct_add(e, nbt_arena_str(arena, "id", mobs[g_rand_int_range(rand, 0, NELEMS(mobs))]));
+		nbt_struct_add(e, pos);
+		nbt_struct_add(e, motion);
+		nbt_struct_add(e, rotation);
+		nbt_struct_add(e, nbt_arena_double(arena, "FallDistance", NBT_TAG_FLOAT, 0));
+		nbt_struct_add(e, nbt_arena_int(arena, "Fire", NBT_TAG_SHORT, -1));
+		nbt_struct_add(e, nbt_arena_int(arena, "Air", NBT_TAG_SHORT, 300));
+		nbt_struct_add(e, nbt_arena_int(arena, "OnGround", NBT_TAG_BYTE, 1));
+		nbt_struct_add(e, nbt_arena_int(arena, "Health", NBT_TAG_SHORT, 10));
+	}
+	nbt_struct_add(level, entities);
+
+	struct nbt_tag *chests = nbt_arena_list(arena, "TileEntities", NBT_TAG_STRUCT, BENCH_CHESTS);
+	for (unsigned i = 0; i < BENCH_CHESTS; i++)
+	{
+		struct nbt_tag *t = nbt_list_item(chests, i);
+		nbt_struct_add(t, nbt_arena_str(arena, "id", "Chest"));
+		nbt_struct_add(t, nbt_arena_int(arena, "x", NBT_TAG_INT, cx*CHUNK_XSIZE + g_rand_int_range(rand, 0, CHUNK_XSIZE)));
+		nbt_struct_add(t, nbt_arena_int(arena, "y", NBT_TAG_INT, g_rand_int_range(rand, 10, 60)));
+		nbt_struct_add(t, nbt_arena_int(arena, "z", NBT_TAG_INT, cz*CHUNK_ZSIZE + g_rand_int_range(rand, 0, CHUNK_ZSIZE)));
+
+		struct nbt_tag *items = nbt_arena_list(arena, "Items", NBT_TAG_STRUCT, BENCH_ITEMS);
+		for (unsigned j = 0; j < BENCH_ITEMS; j++)
+		{
+			struct nbt_tag *item = nbt_list_item(items, j);
+			nbt_struct_add(item, nbt_arena_int(arena, "Slot", NBT_TAG_BYTE, j));
+			nbt_struct_add(item, nbt_arena_int(arena, "id", NBT_TAG_SHORT, g_rand_int_range(rand, 1, 360)));
+			nbt_struct_add(item, nbt_arena_int(arena, "Damage", NBT_TAG_SHORT, 0));
+			nbt_struct_add(item, nbt_arena_int(arena, "Count", NBT_TAG_BYTE, g_rand_int_range(rand, 1, 65)));
+		}
+		nbt_struct_add(t, items);
+	}
+	nbt_struct_add(level, chests);
+
+	nbt_struct_add(level, nbt_arena_long(arena, "LastUpdate", g_rand_int(rand)));
+	nbt_struct_add(level, nbt_arena_int(arena, "xPos", NBT_TAG_INT, cx));
+	nbt_struct_add(level, nbt_arena_int(arena, "zPos", NBT_TAG_INT, cz));
+	nbt_struct_add(level, nbt_arena_int(arena, "TerrainPopulated", NBT_TAG_BYTE, 1));
+
+	struct buffer data = nbt_compress(level);
+	nbt_arena_free(arena);
+	return data;
+}
+
+static void scan_visit(unsigned path, enum nbt_tag_type type, struct buffer payload, void *data)
+{
+	struct buffer *fields = data;
+	fields[path] = payload;
+}
+
+/* measurement */
+
+static GTimer *timer = 0;
+static guint64 stage_allocs = 0;
+
+static void stage_begin(void)
+{
+	stage_allocs = nallocs;
+	g_timer_start(timer);
+}
+
+static void stage_end(const char *name, double amount, const char *unit, unsigned ndocs)
+{
+	double secs = g_timer_elapsed(timer, 0);
+	guint64 allocs = nallocs - stage_allocs;
+
+	printf("%-18s %10.1f %-10s %8.1f allocs/doc\n", name, amount / secs, unit, (double)allocs / ndocs);
+}
+
+int main(int argc, char **argv)
+{
+	count_vtable_install();
+
+	static GOptionEntry gopt_entries[] = {
+		{ "docs", 'n', 0, G_OPTION_ARG_INT, &ndocs, "Documents in the corpus", "N" },
+		{ "passes", 'p', 0, G_OPTION_ARG_INT, &passes, "Passes over the corpus per stage", "N" },
+		{ "world", 'w', 0, G_OPTION_ARG_STRING, &world, "Take the chunks from this world directory", "DIR" },
+		{ NULL }
+	};
+
+	GOptionContext *gopt = g_option_context_new("- benchmark the NBT code");
+	GError *gopt_error = 0;
+
+	g_option_context_add_main_entries(gopt, gopt_entries, 0);
+	if (!g_option_context_parse(gopt, &argc, &argv, &gopt_error))
+		die(gopt_error->message);
+
+	if (ndocs < 1 || passes < 1)
+		die("need at least one document and one pass");
+
+	guint64 probe = nallocs;
+	g_free(g_malloc(1));
+	if (nallocs == probe)
+		printf("allocations can not be counted here; the counts will be zero\n");
+
+	/* the corpus */
+
+	GPtrArray *corpus;
+
+	if (world)
+		corpus = world_chunk_corpus(world, ndocs);
+	else
+	{
+		GRand *rand = g_rand_new_with_seed(1);
+		corpus = g_ptr_array_new();
+		for (int i = 0; i < ndocs; i++)
+		{
+			struct buffer *data = g_new(struct buffer, 1);
+			*data = make_chunk(rand, i % 32, i / 32);
+			g_ptr_array_add(corpus, data);
+		}
+		g_rand_free(rand);
+	}
+
+	unsigned n = corpus->len;
+	if (!n)
+		die("no chunks in the corpus");
+
+	struct buffer *docs = g_new(struct buffer, n);
+	struct nbt_tag **trees = g_new(struct nbt_tag *, n);
+	double zbytes = 0, bytes = 0;
+	const char *error;
+
+	for (unsigned i = 0; i < n; i++)
+	{
+		struct buffer *data = g_ptr_array_index(corpus, i);
+		docs[i] = nbt_inflate(*data, 0, &error);
+		trees[i] = docs[i].data ? nbt_parse(docs[i], &error) : 0;
+		if (!trees[i])
+			dief("corrupted document in the corpus: %s", error);
+		zbytes += data->len;
+		bytes += docs[i].len;
+	}
+
+	printf("%u documents, %.1f kB on average, %.1f kB compressed\n", n, bytes / n / 1024, zbytes / n / 1024);
+
+	double mb = bytes * passes / (1024*1024);
+	unsigned total = n * passes;
+
+	timer = g_timer_new();
+
+	/* the stages; throughput is in uncompressed document bytes */
+
+	stage_begin();
+	for (int p = 0; p < passes; p++)
+		for (unsigned i = 0; i < n; i++)
+			g_free(nbt_inflate(*(struct buffer *)g_ptr_array_index(corpus, i), 0, &error).data);
+	stage_end("nbt_inflate", mb, "MB/s", total);
+
+	stage_begin();
+	for (int p = 0; p < passes; p++)
+		for (unsigned i = 0; i < n; i++)
+			nbt_free(nbt_uncompress(*(struct buffer *)g_ptr_array_index(corpus, i), &error));
+	stage_end("nbt_uncompress", mb, "MB/s", total);
+
+	stage_begin();
+	for (int p = 0; p < passes; p++)
+		for (unsigned i = 0; i < n; i++)
+			nbt_free(nbt_parse(docs[i], &error));
+	stage_end("nbt_parse", mb, "MB/s", total);
+
+	static const char *const paths[] = { "Level/Blocks", "Level/Data", "Level/BlockLight", "Level/SkyLight" };
+	stage_begin();
+	for (int p = 0; p < passes; p++)
+		for (unsigned i = 0; i < n; i++)
+		{
+			struct buffer fields[NELEMS(paths)];
+			nbt_scan(docs[i], paths, NELEMS(paths), scan_visit, fields, &error);
+		}
+	stage_end("nbt_scan", mb, "MB/s", total);
+
+	static const char *names[] = {
+		"Blocks", "Data", "SkyLight", "BlockLight", "HeightMap", "Entities",
+		"TileEntities", "LastUpdate", "xPos", "zPos", "TerrainPopulated", "Missing",
+	};
+	stage_begin();
+	for (int p = 0; p < passes; p++)
+		for (unsigned i = 0; i < n; i++)
+			for (int r = 0; r < BENCH_LOOKUPS; r++)
+				for (unsigned f = 0; f < NELEMS(names); f++)
+					nbt_struct_field(trees[i], names[f]);
+	stage_end("nbt_struct_field", (double)total * BENCH_LOOKUPS * NELEMS(names) / 1e6, "M/s", total);
+
+	stage_begin();
+	for (int p = 0; p < passes; p++)
+		for (unsigned i = 0; i < n; i++)
+			g_free(nbt_serialize(trees[i]).data);
+	stage_end("nbt_serialize", mb, "MB/s", total);
+
+	size_t cap = 0;
+	for (unsigned i = 0; i < n; i++)
+		if (docs[i].len > cap)
+			cap = docs[i].len;
+	void *out = g_malloc(cap);
+
+	stage_begin();
+	for (int p = 0; p < passes; p++)
+		for (unsigned i = 0; i < n; i++)
+		{
+			size_t len;
+			nbt_serialize_into(trees[i], out, cap, &len);
+		}
+	stage_end("nbt_serialize_into", mb, "MB/s", total);
+
+	g_free(out);
+
+	stage_begin();
+	for (int p = 0; p < passes; p++)
+		for (unsigned i = 0; i < n; i++)
+			g_free(nbt_compress(trees[i]).data);
+	stage_end("nbt_compress", mb, "MB/s", total);
+
+	stage_begin();
+	for (int p = 0; p < passes; p++)
+		for (unsigned i = 0; i < n; i++)
+			nbt_compress_temp(trees[i]);
+	stage_end("nbt_compress_temp", mb, "MB/s", total);
+
+	return 0;
+}
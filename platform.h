@@ -19,5 +19,15 @@ void console_cleanup(void);
 mmap_handle_t make_mmap(int fd, size_t len, void **addr);
 mmap_handle_t resize_mmap(mmap_handle_t old, void *old_addr, int fd, size_t old_len, size_t new_len, void **addr);
 void sync_mmap(void *addr, size_t len);
+int flush_mmap(void *addr, size_t len);
+
+int cpu_count(void);
+double cpu_time(void);
+int sync_file(int fd);
+int sync_dir(const char *path);
+int replace_file(const char *from, const char *to);
+
+struct stat;
+gint64 stat_mtime_ns(const struct stat *st);
 
 #endif /* MCMAP_PLATFORM_H */
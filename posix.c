@@ -1,8 +1,11 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <poll.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -186,3 +189,59 @@ void sync_mmap(void *addr, size_t len)
 {
 	msync(addr, len, MS_ASYNC);
 }
+
+int flush_mmap(void *addr, size_t len)
+{
+	/* unlike sync_mmap, waits until the changes are written out */
+	return msync(addr, len, MS_SYNC);
+}
+
+int cpu_count(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+double cpu_time(void)
+{
+	/* seconds used by all threads of the process so far */
+
+	struct rusage ru;
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6
+		+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+int sync_file(int fd)
+{
+	return fsync(fd);
+}
+
+gint64 stat_mtime_ns(const struct stat *st)
+{
+#if defined(__APPLE__)
+	return (gint64)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+	return (gint64)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+int sync_dir(const char *path)
+{
+	/* makes the entries of files created or renamed in it durable */
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return -1;
+
+	int ret = fsync(fd);
+	close(fd);
+	return ret;
+}
+
+int replace_file(const char *from, const char *to)
+{
+	return rename(from, to);
+}
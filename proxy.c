@@ -34,8 +34,8 @@ void start_proxy(socket_t sock_cli, socket_t sock_srv)
 {
 	iq = g_async_queue_new_full(packet_free);
 
-	/* TODO FIXME; call as world_start("world") or some-such to enable alpha-quality region persistence */
-	world_start(0);
+	/* alpha-quality region persistence, if asked for with -w */
+	world_start(opt.worlddir);
 
 	/* start the proxying thread */
 	struct proxy_config *cfg = g_new(struct proxy_config, 1);
@@ -92,8 +92,11 @@ gpointer proxy_thread(gpointer data)
 
 		if (!dpacket->p)
 		{
+			/* the UI thread saves the map tiles on the way out, so the
+			   event must not be lost to a full queue */
 			SDL_Event e = { .type = SDL_QUIT };
-			SDL_PushEvent(&e);
+			while (SDL_PushEvent(&e) != 0)
+				SDL_Delay(10);
 			return 0;
 		}
 
@@ -71,6 +71,8 @@ void start_ui(bool map, int scale, bool resizable, int wnd_w, int wnd_h)
 			switch (e.type)
 			{
 			case SDL_QUIT:
+				if (map)
+					map_close_tiles();
 				TTF_Quit();
 				SDL_Quit();
 				exit(0);
@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <io.h>
 #include <windows.h>
 #include <glib.h>
@@ -62,6 +63,74 @@ void sync_mmap(void *addr, size_t len)
 	FlushViewOfFile(addr, len);
 }
 
+int flush_mmap(void *addr, size_t len)
+{
+	/* only hands the pages to the file; sync_file has to follow */
+	if (!FlushViewOfFile(addr, len))
+	{
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+int cpu_count(void)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+}
+
+double cpu_time(void)
+{
+	/* seconds used by all threads of the process so far */
+
+	FILETIME created, exited, kernel, user;
+	if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+		return 0;
+
+	ULARGE_INTEGER k = { .u = { kernel.dwLowDateTime, kernel.dwHighDateTime } };
+	ULARGE_INTEGER u = { .u = { user.dwLowDateTime, user.dwHighDateTime } };
+	return (k.QuadPart + u.QuadPart) / 1e7; /* in units of 100 ns */
+}
+
+int sync_file(int fd)
+{
+	return _commit(fd);
+}
+
+gint64 stat_mtime_ns(const struct stat *st)
+{
+	/* whole seconds only; the world index treats recent ones as unverified */
+	return (gint64)st->st_mtime * 1000000000;
+}
+
+int sync_dir(const char *path)
+{
+	/* directories can not be opened for _commit; NTFS journals their entries */
+	return 0;
+}
+
+int replace_file(const char *from, const char *to)
+{
+	/* plain rename refuses to overwrite an existing file here */
+
+	gunichar2 *wfrom = g_utf8_to_utf16(from, -1, 0, 0, 0);
+	gunichar2 *wto = g_utf8_to_utf16(to, -1, 0, 0, 0);
+
+	BOOL ok = wfrom && wto && MoveFileExW(wfrom, wto, MOVEFILE_REPLACE_EXISTING|MOVEFILE_WRITE_THROUGH);
+
+	g_free(wfrom);
+	g_free(wto);
+
+	if (!ok)
+	{
+		errno = EACCES;
+		return -1;
+	}
+	return 0;
+}
+
 /* win32 "GUI" nonsense */
 
 static void splash_setargs(HWND hWnd)
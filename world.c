@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdbool.h>
@@ -19,17 +20,20 @@
 #include "types.h"
 #include "platform.h"
 #include "common.h"
+#include "block.h"
 #include "cmd.h"
 #include "console.h"
 #include "nbt.h"
 #include "protocol.h"
+#include "proxy.h"
 #include "world.h"
 #include "map.h"
 
 static GHashTable *region_table = 0;
+G_LOCK_DEFINE_STATIC(region_mutex); /* guards region_table inserts against snapshot lookups */
 
-GHashTable *world_entities = 0;
-G_LOCK_DEFINE(entity_mutex);
+static GHashTable *world_entities = 0;
+static bool entities_changed = false;
 
 static jint entity_player = -1;
 static jint entity_vehicle = -1;
@@ -49,30 +53,241 @@ static char *region_path = 0;
 
 static GAsyncQueue *worldq = 0;
 
+#define WORLD_BATCH 64 /* max packets handled between publishing chunk edits */
+#define WORLD_IDLE_USEC 50000 /* how often to look for chunk requests when idle */
+#define WORLD_LOAD_USEC 5000 /* same, while chunk loads are in progress */
+
+/* chunk versioning: the world thread edits private copies of chunks,
+   and publishes them in batches; replaced versions are freed once no
+   snapshot reader can still be looking at them */
+
+#define SNAPSHOT_SLOTS 8
+
+static volatile gint world_epoch = 1;
+static volatile gint snapshot_readers[SNAPSHOT_SLOTS]; /* 0 = free slot */
+
+struct retired
+{
+	gpointer p;
+	GDestroyNotify destroy;
+	gint epoch;
+};
+
+static GQueue retired = G_QUEUE_INIT;
+static GArray *edited_chunks = 0; /* coord_t: chunks with unpublished edits */
+static GHashTable *map_updates = 0; /* chunk coord_t -> struct column_update */
+
+struct column_update
+{
+	coord_t key; /* chunk coordinates */
+	BITSET(columns, CHUNK_XSIZE*CHUNK_ZSIZE); /* changed columns, z*CHUNK_XSIZE+x */
+};
+
+/* immutable copy of world_entities for drawing, bucketed by chunk */
+
+struct entity_bucket
+{
+	coord_t key; /* chunk coordinates */
+	unsigned first, count;
+};
+
+struct entity_snapshot
+{
+	struct entity *entities; /* sorted by chunk */
+	struct entity_bucket *bucketv;
+	unsigned nentities, nbuckets;
+	GHashTable *buckets; /* chunk coordinates -> struct entity_bucket */
+};
+
+static struct entity_snapshot *entity_snapshot = 0;
+
+/* memory budget: chunks the server unloads, or the least recently used
+   ones over the budget, are written to the region file and freed */
+
+static GQueue chunk_lru = G_QUEUE_INIT; /* coord_t *: most recently used first */
+static unsigned loaded_chunks = 0;
+static unsigned chunk_budget = 0; /* 0 = unlimited */
+static GArray *chunk_unloads = 0; /* coord_t: chunks the server has unloaded */
+static GAsyncQueue *requestq = 0; /* coord_t *: evicted chunks wanted by readers */
+
+/* lazy loading: region files are only indexed at startup, and chunks
+   are brought in when the map or the player gets near them; the world
+   thread copies the compressed data out, the I/O thread parses it */
+
+#define PLAYER_LOAD_RADIUS 8 /* chunks around the player to read from disk */
+
+/* the only parts of a chunk document that loading looks at */
+
+enum chunk_field { CHUNK_BLOCKS, CHUNK_META, CHUNK_LIGHT_BLOCKS, CHUNK_LIGHT_SKY, CHUNK_NFIELDS };
+
+static const char *const chunk_fields[CHUNK_NFIELDS] = {
+	[CHUNK_BLOCKS] = "Level/Blocks",
+	[CHUNK_META] = "Level/Data",
+	[CHUNK_LIGHT_BLOCKS] = "Level/BlockLight",
+	[CHUNK_LIGHT_SKY] = "Level/SkyLight",
+};
+
+struct chunk_load
+{
+	coord_t key; /* chunk coordinates */
+	struct buffer data; /* compressed chunk, copied from the region file */
+	struct buffer doc; /* inflated by the I/O thread */
+	struct buffer fields[CHUNK_NFIELDS]; /* views into doc */
+	const char *error; /* why doc is empty, if it is */
+	bool parsed; /* preload only: result seen by the applier */
+};
+
+static GHashTable *pending_loads = 0; /* world thread only: chunk coord_t -> struct chunk_load */
+static GAsyncQueue *ioq = 0; /* struct chunk_load *: to be parsed */
+static GAsyncQueue *loadq = 0; /* struct chunk_load *: parsed, to be applied */
+
+/* persistence: the world thread hands batches of unsaved chunks to the
+   persist thread every so often, which compresses and writes out their
+   published (and so immutable) versions; chunks cannot be evicted while
+   unsaved or on their way to disk */
+
+#define PERSIST_INTERVAL 30.0 /* seconds between flushing unsaved chunks; the log covers the rest */
+#define PERSIST_BATCH 256 /* flush early when this many chunks are unsaved */
+
+static GHashTable *unsaved = 0; /* world thread only: chunk coord_t * of possibly dirty chunks */
+static GHashTable *persisting = 0; /* world thread only: chunk coord_t -> struct persist_count */
+static GTimer *persist_timer = 0;
+static bool persist_now = false;
+static volatile gint save_requested = 0;
+static GAsyncQueue *persistq = 0; /* GArray of coord_t: chunks to write */
+static GAsyncQueue *persistdoneq = 0; /* same, once written */
+
+struct persist_count
+{
+	coord_t key; /* chunk coordinates */
+	unsigned batches; /* handed off, but not written yet */
+};
+
+/* compression policy: the more chunks are waiting per compression thread,
+   the cheaper the deflate level, and one step cheaper still if the rest of
+   the program leaves little CPU time to spare; chunks written in a hurry
+   are recompressed at the best level once the persist thread has been
+   idle for a while */
+
+#define PERSIST_LEVEL_BEST Z_BEST_COMPRESSION
+#define PERSIST_IDLE_USEC 10000000 /* writer idle time before recompressing */
+#define PERSIST_RECOMPRESS 64 /* chunks recompressed per idle round */
+#define PERSIST_COLD_MAX 16384 /* chunks remembered for recompression */
+#define PERSIST_HEADROOM 0.25 /* share of the CPUs left over for the backlog's level */
+
+static const struct { unsigned backlog; int level; } persist_levels[] = {
+	{ 1024, 0 }, /* stored blocks: hardly more work than copying */
+	{ 256, Z_BEST_SPEED },
+	{ 16, 6 }, /* zlib's default */
+	{ 0, PERSIST_LEVEL_BEST },
+};
+
+struct persist_stats
+{
+	unsigned chunks;
+	guint64 raw, packed; /* bytes in and out */
+	double secs; /* spent compressing, summed over threads */
+};
+
+static volatile gint persist_backlog = 0; /* chunks handed to the persist thread, not yet written */
+static struct persist_stats persist_stats[PERSIST_LEVEL_BEST+1]; /* per level */
+static unsigned persist_recompressed = 0, persist_sects_saved = 0;
+G_LOCK_DEFINE_STATIC(persist_stats);
+
+/* write-ahead log of the edits not yet in the region files */
+
+enum wal_record
+{
+	/* each record is followed by a CRC-32 of it */
+	WAL_BLOCK = 1, /* x, y, z, block type */
+	WAL_CHUNK = 2, /* x0, y0, z0, sizes-1, length, compressed chunk update */
+};
+
+struct wal_msg
+{
+	unsigned seg;
+	GByteArray *records; /* 0: delete segments up to seg */
+};
+
+static GByteArray *wal_pending = 0; /* world thread only: records since the last publish */
+static unsigned wal_seg = 0; /* world thread only: segment being written */
+static GQueue wal_marks = G_QUEUE_INIT; /* world thread only: segment ended by each persist batch */
+static GAsyncQueue *walq = 0; /* struct wal_msg * */
+
 static gpointer world_thread(gpointer data);
+static gpointer io_thread(gpointer data);
+static gpointer persist_thread(gpointer data);
+static gpointer wal_thread(gpointer data);
+static unsigned wal_replay(void);
+static void wal_block(jint x, jint y, jint z, jint type);
+static void wal_chunk(jint x0, jint y0, jint z0, jint xs, jint ys, jint zs, unsigned zlen, unsigned char *zdata);
+static void wal_commit(void);
+static void wal_drop(unsigned seg);
+static void world_publish(void);
+static void world_persist(void);
+static void chunk_persisted(GArray *batch);
 
 struct region_file
 {
-	int fd;
+	char *path;
+	int fd; /* -1 when only indexed */
+	bool header; /* false while only known from the world index */
 	unsigned nsect;
 	unsigned char *contents;
 	mmap_handle_t contents_map;
 	unsigned offsets[REGION_SIZE][REGION_SIZE];
 	uint8_t sects[REGION_SIZE][REGION_SIZE];
 	jint tstamps[REGION_SIZE][REGION_SIZE];
-	unsigned char dirty_chunks[REGION_SIZE][REGION_SIZE];
+	unsigned char dirty_chunks[REGION_SIZE][REGION_SIZE]; /* world thread only */
+	guint64 hashes[REGION_SIZE][REGION_SIZE]; /* world thread only: chunk_hash of contents on disk, 0 if unknown */
 	GByteArray *sect_bitmap;
+	GMutex *lock; /* the rest: contents, layout and size, shared with the persist thread */
+};
+
+/* world index: what the region files held when last seen, so that
+   startup only needs to read the headers of files changed since */
+
+#define INDEX_MAGIC "MCI2"
+#define INDEX_FILE "regions.idx"
+
+struct index_entry
+{
+	coord_t key; /* region coordinates */
+	gint64 mtime, size; /* of the region file; mtime in nanoseconds */
+	BITSET(present, REGION_SIZE*REGION_SIZE);
+	jint tstamps[REGION_SIZE][REGION_SIZE];
 };
 
+static GHashTable *index_entries = 0; /* world_index, then persist thread only */
+
 static void region_free(gpointer gp)
 {
 	struct region *region = gp;
 	for (size_t i = 0; i < NELEMS(region->chunks); i++)
 		for (size_t j = 0; j < NELEMS(region->chunks[i]); j++)
+		{
 			g_free(region->chunks[i][j]);
+			g_free(region->edits[i][j]);
+		}
 	g_free(region);
 }
 
+static void ensure_regfile(struct region *region);
+static struct region_file *regfile_scan(const char *path);
+static struct region_file *regfile_indexed(const char *path, struct index_entry *entry);
+static void regfile_read_header(struct region_file *file);
+static void regfile_map(struct region_file *file);
+static void regfile_remap(struct region_file *file, unsigned old_nsect);
+static void regfile_mark_sectors(struct region_file *file, unsigned start, unsigned n, bool used);
+static unsigned regfile_alloc(struct region_file *file, unsigned n);
+static unsigned regfile_write_data(struct region_file *file, struct buffer data);
+static void regfile_set_location(struct region_file *file, jint cx, jint cz, unsigned offset, unsigned sects);
+static void regfile_new_version(struct region_file *file, jint cx, jint cz);
+static struct buffer regfile_chunk_data(struct region_file *file, jint cx, jint cz);
+static struct buffer regfile_copy_chunk(struct region_file *file, jint cx, jint cz);
+static void regfile_apply_chunk(struct region *region, jint cx, jint cz, struct buffer *fields);
+static void regfile_load_chunk(struct region *region, jint cx, jint cz);
+
 static void entity_free(gpointer ep)
 {
 	struct entity *e = ep;
@@ -80,17 +295,331 @@ static void entity_free(gpointer ep)
 	g_free(e);
 }
 
-void world_start(const char *path)
+static void chunk_field_visit(unsigned path, enum nbt_tag_type type, struct buffer payload, void *data)
 {
-	region_table = g_hash_table_new_full(coord_glib_hash, coord_glib_equal, 0, region_free);
-	world_entities = g_hash_table_new_full(g_int_hash, g_int_equal, 0, entity_free);
-	worldq = g_async_queue_new_full(packet_free);
-	g_thread_create(world_thread, 0, false, 0);
+	struct buffer *fields = data;
 
-	/* locate/create the world directory as required */
+	if (type == NBT_TAG_BLOB)
+		fields[path] = payload;
+}
 
-	if (!path)
-		return;
+static struct buffer chunk_parse(struct buffer data, struct buffer *fields, const char **error)
+{
+	/* a corrupted chunk leaves doc empty, to be skipped by the caller */
+
+	memset(fields, 0, CHUNK_NFIELDS * sizeof *fields);
+
+	struct buffer doc = nbt_inflate(data, 0, error);
+	if (!doc.data)
+		return doc;
+
+	if (!nbt_scan(doc, chunk_fields, CHUNK_NFIELDS, chunk_field_visit, fields, error))
+		goto fail;
+
+	if (fields[CHUNK_BLOCKS].len < CHUNK_NBLOCKS)
+	{
+		*error = "no full Blocks array";
+		goto fail;
+	}
+
+	return doc;
+
+fail:
+	g_free(doc.data);
+	memset(fields, 0, CHUNK_NFIELDS * sizeof *fields);
+	return (struct buffer){ 0 };
+}
+
+static void chunk_skip(coord_t cc, const char *error)
+{
+	log_print("[WARN] Ignoring corrupted chunk at %d,%d: %s", cc.x, cc.z, error);
+}
+
+/* full preload: a pool of threads inflates and parses the chunks, and
+   the results are applied in file order as they become available */
+
+#define PRELOAD_WINDOW 16 /* chunks in flight per thread */
+
+static int preload_region_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct region *ra = *(struct region * const *)a, *rb = *(struct region * const *)b;
+	if (ra->key.z != rb->key.z)
+		return ra->key.z < rb->key.z ? -1 : 1;
+	return ra->key.x < rb->key.x ? -1 : ra->key.x > rb->key.x;
+}
+
+static int preload_offset_cmp(const void *a, const void *b)
+{
+	/* the chunk data points into the mapping of one region file */
+	uintptr_t pa = (uintptr_t)(*(struct chunk_load * const *)a)->data.data;
+	uintptr_t pb = (uintptr_t)(*(struct chunk_load * const *)b)->data.data;
+	return pa < pb ? -1 : pa > pb;
+}
+
+static void preload_parse(gpointer data, gpointer user_data)
+{
+	struct chunk_load *load = data;
+	GAsyncQueue *doneq = user_data;
+
+	load->doc = chunk_parse(load->data, load->fields, &load->error);
+	g_async_queue_push(doneq, load);
+}
+
+static void world_preload(void)
+{
+	int nthreads = opt.threads ? opt.threads : cpu_count();
+
+	/* list every chunk only on disk, region by region, each one's chunks
+	   in the order they are stored in its file */
+
+	GPtrArray *regions = g_ptr_array_new();
+
+	GHashTableIter region_iter;
+	struct region *region;
+	g_hash_table_iter_init(&region_iter, region_table);
+	while (g_hash_table_iter_next(&region_iter, NULL, (gpointer *) &region))
+		g_ptr_array_add(regions, region);
+	g_ptr_array_sort(regions, preload_region_cmp);
+
+	GArray *loads = g_array_new(false, false, sizeof(struct chunk_load *));
+
+	for (unsigned i = 0; i < regions->len; i++)
+	{
+		region = g_ptr_array_index(regions, i);
+		unsigned first = loads->len;
+
+		for (jint cz = 0; cz < REGION_SIZE; cz++)
+			for (jint cx = 0; cx < REGION_SIZE; cx++)
+			{
+				if (!BITSET_TEST(region->evicted, cz*REGION_SIZE+cx))
+					continue;
+
+				ensure_regfile(region);
+
+				/* nothing writes to the files yet, so the mapping can be parsed directly */
+				struct chunk_load *load = g_new(struct chunk_load, 1);
+				load->key = COORD(region->key.x + cx*CHUNK_XSIZE, region->key.z + cz*CHUNK_ZSIZE);
+				load->data = regfile_chunk_data(region->file, cx, cz);
+				load->doc = (struct buffer){ 0 };
+				load->parsed = false;
+				g_array_append_val(loads, load);
+			}
+
+		if (loads->len > first)
+			qsort(&g_array_index(loads, struct chunk_load *, first), loads->len - first,
+			      sizeof(struct chunk_load *), preload_offset_cmp);
+	}
+
+	g_ptr_array_free(regions, true);
+
+	log_print("[INFO] Preloading %u chunks with %d threads", loads->len, nthreads);
+
+	GAsyncQueue *doneq = g_async_queue_new();
+	GError *error = 0;
+	GThreadPool *pool = g_thread_pool_new(preload_parse, doneq, nthreads, true, &error);
+	if (!pool)
+		dief("unable to start preload threads: %s", error->message);
+
+	unsigned window = nthreads * PRELOAD_WINDOW;
+	unsigned queued = 0, applied = 0, reported = 0;
+
+	for (; queued < loads->len && queued < window; queued++)
+		g_thread_pool_push(pool, g_array_index(loads, struct chunk_load *, queued), 0);
+
+	while (applied < loads->len)
+	{
+		/* results arrive in any order; apply the next one in line once it is in */
+
+		struct chunk_load *next = g_array_index(loads, struct chunk_load *, applied);
+
+		while (!next->parsed)
+		{
+			struct chunk_load *done = g_async_queue_pop(doneq);
+			done->parsed = true;
+		}
+
+		struct region *r = world_region(next->key, false);
+		jint xo = CHUNK_XIDX(REGION_XOFF(next->key.x)), zo = CHUNK_ZIDX(REGION_ZOFF(next->key.z));
+
+		BITSET_CLEAR(r->evicted, zo*REGION_SIZE+xo);
+		if (next->doc.data)
+			regfile_apply_chunk(r, xo, zo, next->fields);
+		else
+			chunk_skip(next->key, next->error);
+
+		g_free(next->doc.data);
+		g_free(next);
+		applied++;
+
+		if (queued < loads->len)
+			g_thread_pool_push(pool, g_array_index(loads, struct chunk_load *, queued++), 0);
+
+		if (applied * 10 / loads->len > reported)
+		{
+			reported = applied * 10 / loads->len;
+			log_print("[INFO] Preloading: %u/%u chunks", applied, loads->len);
+		}
+	}
+
+	g_thread_pool_free(pool, false, true);
+	g_async_queue_unref(doneq);
+	g_array_free(loads, true);
+
+	world_publish();
+}
+
+static struct index_entry *index_entry_new(coord_t rc, struct region_file *file, struct stat *st)
+{
+	/* caller holds the lock, unless nothing else can see the file yet */
+
+	struct index_entry *entry = g_new(struct index_entry, 1);
+	entry->key = rc;
+	entry->mtime = stat_mtime_ns(st);
+	entry->size = st->st_size;
+	memset(entry->present, 0, sizeof entry->present);
+
+	for (jint cz = 0; cz < REGION_SIZE; cz++)
+		for (jint cx = 0; cx < REGION_SIZE; cx++)
+		{
+			entry->tstamps[cz][cx] = file->tstamps[cz][cx];
+			if (file->offsets[cz][cx] && file->sects[cz][cx])
+				BITSET_SET(entry->present, cz*REGION_SIZE+cx);
+		}
+
+	return entry;
+}
+
+static GHashTable *index_load(gint64 *saved)
+{
+	/* a missing or damaged index just means scanning every region file;
+	   saved is when the index was written, 0 if there is none */
+
+	GHashTable *entries = g_hash_table_new_full(coord_glib_hash, coord_glib_equal, 0, g_free);
+
+	char *path = g_strdup_printf("%s/" INDEX_FILE, world_path);
+	gchar *contents;
+	gsize len;
+	struct stat st;
+
+	*saved = 0;
+
+	if (g_stat(path, &st) != 0 || !g_file_get_contents(path, &contents, &len, 0))
+	{
+		g_free(path);
+		return entries;
+	}
+
+	unsigned char *p = (unsigned char *) contents, *end = p + len;
+
+	if (len >= 4 && memcmp(p, "MCI", 3) == 0 && memcmp(p, INDEX_MAGIC, 4) != 0)
+	{
+		/* from another version: rebuilt without complaint */
+		g_free(contents);
+		g_free(path);
+		return entries;
+	}
+
+	if (len < 8 || memcmp(p, INDEX_MAGIC, 4) != 0)
+		goto corrupt;
+
+	*saved = stat_mtime_ns(&st);
+
+	guint32 n = jint_read(p+4);
+	p += 8;
+
+	while (n--)
+	{
+		struct index_entry *entry = g_new0(struct index_entry, 1);
+
+		if (end - p < 24 + (ptrdiff_t) sizeof entry->present)
+		{
+			g_free(entry);
+			goto corrupt;
+		}
+
+		entry->key = COORD(jint_read(p), jint_read(p+4));
+		entry->mtime = jlong_read(p+8);
+		entry->size = jlong_read(p+16);
+		p += 24;
+
+		memcpy(entry->present, p, sizeof entry->present);
+		p += sizeof entry->present;
+
+		/* timestamps only for the chunks present */
+		for (int i = 0; i < REGION_SIZE*REGION_SIZE; i++)
+		{
+			if (!BITSET_TEST(entry->present, i))
+				continue;
+			if (end - p < 4)
+			{
+				g_free(entry);
+				goto corrupt;
+			}
+			entry->tstamps[i / REGION_SIZE][i % REGION_SIZE] = jint_read(p);
+			p += 4;
+		}
+
+		g_hash_table_insert(entries, &entry->key, entry);
+	}
+
+	g_free(contents);
+	g_free(path);
+	return entries;
+
+corrupt:
+	log_print("[WARN] Ignoring corrupted world index: %s", path);
+	g_hash_table_remove_all(entries);
+	g_free(contents);
+	g_free(path);
+	return entries;
+}
+
+static void index_save(void)
+{
+	GByteArray *out = g_byte_array_new();
+	unsigned char buf[24];
+
+	g_byte_array_append(out, (const guint8 *) INDEX_MAGIC, 4);
+	jint_write(buf, g_hash_table_size(index_entries));
+	g_byte_array_append(out, buf, 4);
+
+	GHashTableIter iter;
+	struct index_entry *entry;
+
+	g_hash_table_iter_init(&iter, index_entries);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) &entry))
+	{
+		jint_write(buf, entry->key.x);
+		jint_write(buf+4, entry->key.z);
+		jlong_write(buf+8, entry->mtime);
+		jlong_write(buf+16, entry->size);
+		g_byte_array_append(out, buf, 24);
+		g_byte_array_append(out, entry->present, sizeof entry->present);
+
+		for (int i = 0; i < REGION_SIZE*REGION_SIZE; i++)
+			if (BITSET_TEST(entry->present, i))
+			{
+				jint_write(buf, entry->tstamps[i / REGION_SIZE][i % REGION_SIZE]);
+				g_byte_array_append(out, buf, 4);
+			}
+	}
+
+	/* only a cache: if it goes stale, the mtime checks catch that */
+	char *path = g_strdup_printf("%s/" INDEX_FILE, world_path);
+	GError *error = 0;
+	if (!g_file_set_contents(path, (gchar *) out->data, out->len, &error))
+	{
+		log_print("[WARN] Unable to save world index: %s", error->message);
+		g_error_free(error);
+	}
+	g_free(path);
+
+	g_byte_array_free(out, true);
+}
+
+static void world_index(const char *path)
+{
+	/* locate/create the world directory as required */
 
 	world_path = g_strdup(path);
 	region_path = g_strdup_printf("%s/region", world_path);
@@ -108,14 +637,21 @@ void world_start(const char *path)
 			dief("unable to create region directory: %s", region_path);
 	}
 
-	/* scan and index all existing region files */
-	/* TODO: maybe log something about this? shouldn't take long... */
+	/* index all existing region files; only the headers of the ones
+	   changed since the world index was saved are read, and the chunks
+	   in them are loaded when needed */
+
+	gint64 index_saved;
+	GHashTable *old_entries = index_load(&index_saved);
+	index_entries = g_hash_table_new_full(coord_glib_hash, coord_glib_equal, 0, g_free);
 
 	GError *error = 0;
 	GDir *dir = g_dir_open(region_path, 0, &error);
 	if (!dir)
 		dief("unable to scan region directory contents: %s", error->message);
 
+	unsigned nregions = 0, nchunks = 0, nscanned = 0;
+
 	const char *region_file = 0;
 	while ((region_file = g_dir_read_name(dir)))
 	{
@@ -130,11 +666,110 @@ void world_start(const char *path)
 		coord_t rc = COORD(x * REGION_XSIZE, z * REGION_ZSIZE);
 		struct region *region = world_region(rc, true);
 		char *region_file_path = g_strdup_printf("%s/%s", region_path, region_file);
-		region->file = world_regfile_open(region_file_path);
+
+		struct stat st;
+		if (g_stat(region_file_path, &st) != 0)
+			dief("unable to stat region file: %s: %s", region_file_path, g_strerror(errno));
+
+		struct index_entry *entry = g_hash_table_lookup(old_entries, &rc);
+
+		/* a file changed within the same clock tick as it was indexed keeps
+		   its mtime, so only entries older than the index itself are trusted */
+		if (entry && entry->mtime == stat_mtime_ns(&st) && entry->size == st.st_size && entry->mtime < index_saved)
+		{
+			/* unchanged: the header is read when the first chunk is needed */
+			g_hash_table_steal(old_entries, &rc);
+			region->file = regfile_indexed(region_file_path, entry);
+		}
+		else
+		{
+			region->file = regfile_scan(region_file_path);
+
+			/* the mapping is made when the first chunk is needed */
+			close(region->file->fd);
+			region->file->fd = -1;
+
+			/* scanning may have rounded the size up */
+			if (g_stat(region_file_path, &st) != 0)
+				dief("unable to stat region file: %s: %s", region_file_path, g_strerror(errno));
+
+			entry = index_entry_new(rc, region->file, &st);
+			nscanned++;
+		}
+
+		g_hash_table_insert(index_entries, &entry->key, entry);
 		g_free(region_file_path);
 
-		/* TODO FIXME: debugging code: load all regions to memory at start */
-		world_regfile_load(region);
+		for (jint cz = 0; cz < REGION_SIZE; cz++)
+			for (jint cx = 0; cx < REGION_SIZE; cx++)
+				if (BITSET_TEST(entry->present, cz*REGION_SIZE+cx))
+				{
+					BITSET_SET(region->evicted, cz*REGION_SIZE+cx);
+					region->versions[cz*REGION_SIZE+cx] = entry->tstamps[cz][cx];
+					nchunks++;
+				}
+
+		nregions++;
+	}
+
+	g_dir_close(dir);
+
+	/* anything left over is for files that are gone */
+	if (nscanned || g_hash_table_size(old_entries))
+		index_save();
+	g_hash_table_destroy(old_entries);
+
+	log_print("[INFO] Indexed %u chunks in %u region files (%u scanned)", nchunks, nregions, nscanned);
+
+	if (opt.preload)
+		world_preload();
+
+	unsigned nrecs = wal_replay();
+	if (nrecs)
+	{
+		log_print("[INFO] Replayed %u write-ahead log records", nrecs);
+		world_publish();
+	}
+
+	wal_pending = g_byte_array_new();
+}
+
+void world_start(const char *path)
+{
+	region_table = g_hash_table_new_full(coord_glib_hash, coord_glib_equal, 0, region_free);
+	world_entities = g_hash_table_new_full(g_int_hash, g_int_equal, 0, entity_free);
+	worldq = g_async_queue_new_full(packet_free);
+	edited_chunks = g_array_new(false, false, sizeof(coord_t));
+	map_updates = g_hash_table_new_full(coord_glib_hash, coord_glib_equal, 0, g_free);
+	chunk_unloads = g_array_new(false, false, sizeof(coord_t));
+	requestq = g_async_queue_new_full(g_free);
+	pending_loads = g_hash_table_new(coord_glib_hash, coord_glib_equal);
+	ioq = g_async_queue_new();
+	loadq = g_async_queue_new();
+	unsaved = g_hash_table_new_full(coord_glib_hash, coord_glib_equal, g_free, 0);
+	persisting = g_hash_table_new_full(coord_glib_hash, coord_glib_equal, 0, g_free);
+	persist_timer = g_timer_new();
+	persistq = g_async_queue_new();
+	persistdoneq = g_async_queue_new();
+	walq = g_async_queue_new();
+
+	if (opt.memlimit)
+	{
+		if (path)
+			chunk_budget = (guint64)opt.memlimit * 1024 * 1024 / sizeof(struct chunk);
+		else
+			log_print("[WARN] Ignoring memory budget: no world directory to evict chunks to");
+	}
+
+	if (path)
+		world_index(path);
+
+	g_thread_create(world_thread, 0, false, 0);
+	g_thread_create(io_thread, 0, false, 0);
+	if (path)
+	{
+		g_thread_create(persist_thread, 0, false, 0);
+		g_thread_create(wal_thread, 0, false, 0);
 	}
 }
 
@@ -163,11 +798,19 @@ struct region *world_region(coord_t cc, bool gen)
 	/* Can't use g_malloc0; NULL might not be all-bits-zero */
 	for (size_t i = 0; i < NELEMS(region->chunks); i++)
 		for (size_t j = 0; j < NELEMS(region->chunks[i]); j++)
+		{
 			region->chunks[i][j] = NULL;
+			region->edits[i][j] = NULL;
+			region->lru[i][j] = NULL;
+		}
 
+	memset(region->evicted, 0, sizeof region->evicted);
+	memset(region->versions, 0, sizeof region->versions);
 	region->file = 0;
 
+	G_LOCK(region_mutex);
 	g_hash_table_insert(region_table, &region->key, region);
+	G_UNLOCK(region_mutex);
 
 	return region;
 }
@@ -181,854 +824,2659 @@ struct chunk *world_chunk(coord_t cc, bool gen)
 
 	jint xo = CHUNK_XIDX(REGION_XOFF(cc.x)), zo = CHUNK_ZIDX(REGION_ZOFF(cc.z));
 
+	if (region->edits[xo][zo])
+		return region->edits[xo][zo];
+
 	if (gen && !region->chunks[xo][zo])
-		region->chunks[xo][zo] = g_malloc0(sizeof(struct chunk));
+		return world_chunk_edit(cc, true);
 
 	return region->chunks[xo][zo];
 }
 
-unsigned char *world_stack(coord_t cc, bool gen)
+struct chunk *world_chunk_edit(coord_t cc, bool gen)
 {
-	struct chunk *c = world_chunk(cc, gen);
-	if (!c)
+	struct region *region = world_region(cc, gen);
+
+	if (!region)
 		return 0;
 
-	return c->blocks[CHUNK_XOFF(cc.x)][CHUNK_ZOFF(cc.z)];
-}
+	jint xo = CHUNK_XIDX(REGION_XOFF(cc.x)), zo = CHUNK_ZIDX(REGION_ZOFF(cc.z));
+	coord_t key = COORD(CHUNK_XMASK(cc.x), CHUNK_ZMASK(cc.z));
+	struct chunk *c = region->edits[xo][zo];
+
+	if (!c && !region->chunks[xo][zo] && BITSET_TEST(region->evicted, zo*REGION_SIZE+xo))
+	{
+		/* revisiting an evicted chunk; the reload leaves an edit behind */
+		BITSET_CLEAR(region->evicted, zo*REGION_SIZE+xo);
+		regfile_load_chunk(region, xo, zo);
+		c = region->edits[xo][zo];
+	}
 
-jint world_getheight(coord_t cc)
-{
-	struct chunk *c = world_chunk(cc, false);
 	if (!c)
-		return -1;
+	{
+		/* copy-on-write: published versions are never modified */
 
-	return c->height[CHUNK_XOFF(cc.x)][CHUNK_ZOFF(cc.z)];
-}
+		if (region->chunks[xo][zo])
+			c = g_memdup(region->chunks[xo][zo], sizeof *c);
+		else if (gen)
+			c = g_malloc0(sizeof *c);
+		else
+			return 0;
 
-static bool handle_compressed_chunk(jint x0, jint y0, jint z0,
-                                    jint xs, jint ys, jint zs,
-                                    unsigned zlen, unsigned char *zdata,
-                                    bool update_map)
-{
-	static unsigned char zbuf[256*1024];
-	int err;
-
-	z_stream zstr = {
-		.next_in = zdata,
-		.avail_in = zlen,
-		.next_out = zbuf,
-		.avail_out = sizeof zbuf
-	};
-
-	if ((err = inflateInit(&zstr)) != Z_OK)
-	{
-		log_print("[WHAT] chunk update decompression: inflateInit: %s", zError(err));
-		return false;
+		region->edits[xo][zo] = c;
+		g_array_append_val(edited_chunks, key);
 	}
 
-	while (zstr.avail_in)
+	/* any edit marks the chunk dirty, and loads clear the flag again once
+	   they are done; world_persist skips it if its contents still hash to
+	   what is on disk */
+	if (region->file)
+		region->file->dirty_chunks[zo][xo] = 1;
+	g_atomic_int_set(&region->versions[zo*REGION_SIZE+xo], 0);
+	if (region_path && !g_hash_table_lookup(unsaved, &key))
 	{
-		err = inflate(&zstr, Z_PARTIAL_FLUSH);
-		if (err != Z_OK && err != Z_STREAM_END)
-		{
-			log_print("[WHAT] chunk update decompression: inflate: %s", zError(err));
-			return false;
-		}
-		if (err == Z_STREAM_END)
-			break;
+		coord_t *k = g_new(coord_t, 1);
+		*k = key;
+		g_hash_table_insert(unsaved, k, k);
 	}
 
-	int zbuf_len = (sizeof zbuf) - zstr.avail_out;
-	inflateEnd(&zstr);
+	return c;
+}
 
-	if (zbuf_len < xs*ys*zs)
-	{
-		log_print("[WHAT] broken decompressed chunk length: %d != %d and < %d",
-		      (int)zbuf_len, (int)(5*xs*ys*zs+1)/2, xs*ys*zs);
-		return false;
-	}
+static uint8_t *world_map_columns(coord_t cc)
+{
+	/* map updates are deferred until the edits are visible to the map painting code */
 
-	if (y0 > CHUNK_YSIZE)
+	coord_t key = COORD(CHUNK_XMASK(cc.x), CHUNK_ZMASK(cc.z));
+	struct column_update *u = g_hash_table_lookup(map_updates, &key);
+
+	if (!u)
 	{
-		log_print("[WHAT] too high chunk update: %d..%d", y0, y0+ys-1);
-		return false;
+		u = g_new0(struct column_update, 1);
+		u->key = key;
+		g_hash_table_insert(map_updates, &u->key, u);
 	}
-	else if (y0 + ys > CHUNK_YSIZE)
-		ys = CHUNK_YSIZE - y0;
 
-	// FIXME: These lengths are too big, because they include the buffers after them.
-	// Not really a problem, though.
-	struct buffer zb = { zbuf_len, zbuf };
-#ifdef FEAT_FULLCHUNK
-	struct buffer zb_meta = offset_buffer(zb, xs*ys*zs);
-	struct buffer zb_light_blocks = offset_buffer(zb_meta, (xs*ys*zs+1)/2);
-	struct buffer zb_light_sky = offset_buffer(zb_light_blocks, (xs*ys*zs+1)/2);
-#else
-	struct buffer zb_meta = { 0, 0 };
-	struct buffer zb_light_blocks = { 0, 0 };
-	struct buffer zb_light_sky = { 0, 0 };
-#endif
-	return world_handle_chunk(x0, y0, z0, xs, ys, zs, zb, zb_meta, zb_light_blocks, zb_light_sky, update_map);
+	return u->columns;
 }
 
-bool world_handle_chunk(jint x0, jint y0, jint z0,
-                            jint xs, jint ys, jint zs,
-                            struct buffer zb, struct buffer zb_meta,
-                            struct buffer zb_light_blocks, struct buffer zb_light_sky,
-                            bool update_map)
+static void chunk_touch(struct region *region, jint xo, jint zo)
 {
-	bool set_chunk = false;
-	coord_t current_chunk = COORD(0, 0);
-	struct chunk *c = 0;
+	GList *link = region->lru[xo][zo];
 
-	if (ys < 0)
+	if (link)
 	{
-		log_print("[WARN] Invalid chunk size! Probably WorldEdit; go yell at the author.");
-		return false;
+		g_queue_unlink(&chunk_lru, link);
+		g_queue_push_head_link(&chunk_lru, link);
+		return;
 	}
 
-	jint c_min_x = INT_MAX, c_min_z = INT_MAX;
-	jint c_max_x = INT_MIN, c_max_z = INT_MIN;
-	bool changed = false;
-
-	for (jint x = x0; x < x0+xs; x++)
-	{
-		for (jint z = z0; z < z0+zs; z++)
-		{
-			coord_t cc = COORD(CHUNK_XMASK(x), CHUNK_ZMASK(z));
-
-			if (!coord_equal(cc, current_chunk) || !set_chunk)
-			{
-				set_chunk = true;
-				c = world_chunk(cc, true);
-				current_chunk = cc;
-
-				/* TODO FIXME: marks dirty always, even when loading from disk; also unoptimal */
-				struct region *r = world_region(cc, false);
-				if (r && r->file)
-					r->file->dirty_chunks[CHUNK_ZIDX(REGION_ZOFF(cc.z))][CHUNK_XIDX(REGION_XOFF(cc.x))] = 1;
-			}
-
-			if (!changed && memcmp(&c->blocks[CHUNK_XOFF(x)][CHUNK_ZOFF(z)][y0], zb.data, ys) != 0)
-				changed = true;
+	coord_t *key = g_new(coord_t, 1);
+	*key = COORD(region->key.x + xo*CHUNK_XSIZE, region->key.z + zo*CHUNK_ZSIZE);
+	g_queue_push_head(&chunk_lru, key);
+	region->lru[xo][zo] = chunk_lru.head;
+	loaded_chunks++;
+}
 
-			memcpy(&c->blocks[CHUNK_XOFF(x)][CHUNK_ZOFF(z)][y0], zb.data, ys);
-			ADVANCE_BUFFER(zb, ys);
+static void world_retire(gpointer p, GDestroyNotify destroy, gint epoch);
 
-#ifdef FEAT_FULLCHUNK
-			size_t bytes = (ys+1)/2;
+static bool chunk_saved(coord_t cc)
+{
+	struct region *region = world_region(cc, false);
 
-			if (bytes <= zb_meta.len)
-			{
-				memcpy(&c->meta[(CHUNK_XOFF(x)*CHUNK_ZSIZE + CHUNK_ZOFF(z))*(CHUNK_YSIZE/2) + y0/2], zb_meta.data, bytes);
-				ADVANCE_BUFFER(zb_meta, bytes);
-			}
+	if (!region_path || !region)
+		return true;
 
-			if (bytes <= zb_light_blocks.len)
-			{
-				memcpy(&c->light_blocks[(CHUNK_XOFF(x)*CHUNK_ZSIZE + CHUNK_ZOFF(z))*(CHUNK_YSIZE/2) + y0/2], zb_light_blocks.data, bytes);
-				ADVANCE_BUFFER(zb_light_blocks, (ys+1)/2);
-			}
+	jint xo = CHUNK_XIDX(REGION_XOFF(cc.x)), zo = CHUNK_ZIDX(REGION_ZOFF(cc.z));
+	coord_t key = COORD(CHUNK_XMASK(cc.x), CHUNK_ZMASK(cc.z));
 
-			if (bytes <= zb_light_sky.len)
-			{
-				memcpy(&c->light_sky[(CHUNK_XOFF(x)*CHUNK_ZSIZE + CHUNK_ZOFF(z))*(CHUNK_YSIZE/2) + y0/2], zb_light_sky.data, bytes);
-				ADVANCE_BUFFER(zb_light_sky, (ys+1)/2);
-			}
-#endif
+	if (region->file && region->file->dirty_chunks[zo][xo])
+		return false;
+	return !g_hash_table_lookup(persisting, &key);
+}
 
-			jint h = c->height[CHUNK_XOFF(x)][CHUNK_ZOFF(z)];
+static bool chunk_evict(coord_t cc, gint epoch)
+{
+	if (!region_path)
+		return false; /* nowhere to put it */
 
-			if (y0+ys >= h)
-			{
-				jint newh = y0 + ys;
-				if (newh >= CHUNK_YSIZE)
-					newh = CHUNK_YSIZE - 1;
+	struct region *region = world_region(cc, false);
+	if (!region)
+		return false;
 
-				unsigned char *stack = c->blocks[CHUNK_XOFF(x)][CHUNK_ZOFF(z)];
+	jint xo = CHUNK_XIDX(REGION_XOFF(cc.x)), zo = CHUNK_ZIDX(REGION_ZOFF(cc.z));
+	struct chunk *c = region->chunks[xo][zo];
 
-				while (!stack[newh] && newh > 0)
-					newh--;
+	if (!c || region->edits[xo][zo])
+		return false;
 
-				c->height[CHUNK_XOFF(x)][CHUNK_ZOFF(z)] = newh;
-				changed = true;
-			}
+	ensure_regfile(region);
 
-			if (cc.x < c_min_x) c_min_x = cc.x;
-			if (cc.x > c_max_x) c_max_x = cc.x;
-			if (cc.z < c_min_z) c_min_z = cc.z;
-			if (cc.z > c_max_z) c_max_z = cc.z;
-		}
+	if (!chunk_saved(cc))
+	{
+		/* not on disk yet; try again once it is */
+		persist_now = true;
+		return false;
 	}
 
-	if (changed && update_map)
-		map_update(COORD(c_min_x, c_min_z), COORD(c_max_x, c_max_z));
+	g_atomic_pointer_set((volatile gpointer *) &region->chunks[xo][zo], 0);
+	world_retire(c, g_free, epoch);
+	BITSET_SET(region->evicted, zo*REGION_SIZE+xo);
 
-	return changed;
+	GList *link = region->lru[xo][zo];
+	g_free(link->data);
+	g_queue_delete_link(&chunk_lru, link);
+	region->lru[xo][zo] = 0;
+	loaded_chunks--;
+
+	return true;
 }
 
-static inline int block_change(struct chunk *c, jint x, jint y, jint z, unsigned char type)
+static void chunk_load_async(coord_t cc)
 {
-	if (y < 0 || y >= CHUNK_YSIZE)
-		return 0; /* sometimes server sends Y=CHUNK_YSIZE block-to-air "updates" */
+	struct region *region = world_region(cc, false);
+	jint xo = CHUNK_XIDX(REGION_XOFF(cc.x)), zo = CHUNK_ZIDX(REGION_ZOFF(cc.z));
 
-	int changed = (c->blocks[x][z][y] != type);
-	c->blocks[x][z][y] = type;
+	if (!region || region->chunks[xo][zo] || !BITSET_TEST(region->evicted, zo*REGION_SIZE+xo))
+		return; /* not only on disk */
 
-	if (y >= c->height[x][z])
-	{
-		jint newh = y;
+	coord_t key = COORD(CHUNK_XMASK(cc.x), CHUNK_ZMASK(cc.z));
+	if (g_hash_table_lookup(pending_loads, &key))
+		return; /* already on its way */
 
-		if (!type)
-			while (!c->blocks[x][z][newh] && newh > 0)
-				newh--;
+	ensure_regfile(region);
+	struct buffer data = regfile_copy_chunk(region->file, xo, zo);
 
-		if (c->height[x][z] != newh)
-			changed = 1;
-		c->height[x][z] = newh;
+	if (!data.len)
+	{
+		BITSET_CLEAR(region->evicted, zo*REGION_SIZE+xo);
+		return;
 	}
 
-	return changed;
+	struct chunk_load *load = g_new(struct chunk_load, 1);
+	load->key = key;
+	load->data = data;
+	load->doc = (struct buffer){ 0 };
+	load->parsed = false;
+
+	g_hash_table_insert(pending_loads, &load->key, load);
+	g_async_queue_push(ioq, load);
 }
 
-static void handle_multi_set_block(jint cx, jint cz, jint size, unsigned char *coord, unsigned char *type)
+static void chunk_load_around(coord3_t pos)
 {
-	coord_t cc = COORD(cx, cz);
-	struct chunk *c = world_chunk(cc, false);
-	if (!c)
-		return; /* edit in an unloaded chunk */
+	for (jint dz = -PLAYER_LOAD_RADIUS; dz <= PLAYER_LOAD_RADIUS; dz++)
+		for (jint dx = -PLAYER_LOAD_RADIUS; dx <= PLAYER_LOAD_RADIUS; dx++)
+			chunk_load_async(COORD(pos.x + dx*CHUNK_XSIZE, pos.z + dz*CHUNK_ZSIZE));
+}
 
-	int changed = 0;
+static void chunk_load_done(struct chunk_load *load)
+{
+	/* a synchronous load of the same chunk in the meanwhile supersedes this one */
 
-	while (size--)
+	if (g_hash_table_lookup(pending_loads, &load->key) == load)
 	{
-		int x = coord[0] >> 4, y = coord[1], z = coord[0] & 0x0f;
-		coord += 2;
-		if (block_change(c, x, y, z, *type++))
-			changed = 1;
-	}
+		g_hash_table_remove(pending_loads, &load->key);
 
-	if (changed)
-		map_update(cc, cc);
-}
+		struct region *region = world_region(load->key, false);
+		jint xo = CHUNK_XIDX(REGION_XOFF(load->key.x)), zo = CHUNK_ZIDX(REGION_ZOFF(load->key.z));
 
-static void handle_set_block(jint x, jint y, jint z, jint type)
-{	
-	coord_t cc = COORD(x, z);
-	struct chunk *c = world_chunk(cc, false);
-	if (!c)
-		return; /* edit in an unloaded chunk */
+		BITSET_CLEAR(region->evicted, zo*REGION_SIZE+xo);
+		if (load->doc.data)
+			regfile_apply_chunk(region, xo, zo, load->fields);
+		else
+			chunk_skip(load->key, load->error);
+	}
 
-	if (block_change(c, CHUNK_XOFF(x), y, CHUNK_ZOFF(z), type))
-		map_update(cc, cc);
+	g_free(load->doc.data);
+	g_free(load->data.data);
+	g_free(load);
 }
 
-static void update_player_pos(double x, double y, double z)
+static void chunk_handle_requests(void)
 {
-	coord3_t new_pos = COORD3(floor(x), floor(y), floor(z));
+	coord_t *cc;
+	struct chunk_load *load;
 
-	if (coord3_equal(player_pos, new_pos))
-		return;
+	while ((cc = g_async_queue_try_pop(requestq)))
+	{
+		chunk_load_async(*cc);
+		g_free(cc);
+	}
 
-	player_pos = new_pos;
+	while ((load = g_async_queue_try_pop(loadq)))
+		chunk_load_done(load);
 
-	map_mode->update_player_pos(map_mode->data);
-	map_repaint();
+	GArray *batch;
+	while ((batch = g_async_queue_try_pop(persistdoneq)))
+		chunk_persisted(batch);
 }
 
-static void update_player_dir(double yaw)
+static gpointer io_thread(gpointer data)
 {
-	int new_yaw = 0;
+	while (1)
+	{
+		struct chunk_load *load = g_async_queue_pop(ioq);
+		load->doc = chunk_parse(load->data, load->fields, &load->error);
+		g_async_queue_push(loadq, load);
+	}
 
-	yaw = fmod(yaw, 360.0);
+	return 0;
+}
 
-	if (yaw < 0.0) yaw += 360.0;
-	if (yaw > 360-22.5) yaw -= 360;
+static void world_retire(gpointer p, GDestroyNotify destroy, gint epoch)
+{
+	struct retired *r = g_new(struct retired, 1);
+	r->p = p;
+	r->destroy = destroy;
+	r->epoch = epoch;
+	g_queue_push_tail(&retired, r);
+}
 
-	while (new_yaw < 7 && yaw > 22.5)
-		new_yaw++, yaw -= 45.0;
+static void world_reclaim(void)
+{
+	/* a reader that entered at epoch e may hold any version retired at e or later */
 
-	if (new_yaw == player_yaw)
-		return;
+	guint now = g_atomic_int_get(&world_epoch);
+	guint max_age = 0;
 
-	player_yaw = new_yaw;
+	for (int i = 0; i < SNAPSHOT_SLOTS; i++)
+	{
+		guint e = g_atomic_int_get(&snapshot_readers[i]);
+		if (e && now - e > max_age)
+			max_age = now - e;
+	}
 
-	map_repaint();
+	struct retired *r;
+	while ((r = g_queue_peek_head(&retired)) && now - (guint)r->epoch > max_age)
+	{
+		g_queue_pop_head(&retired);
+		r->destroy(r->p);
+		g_free(r);
+	}
 }
 
-static void entity_add(jint id, enum entity_type type, jshort subtype,
-                       unsigned char *name, jint x, jint y, jint z)
+static int entity_chunk_cmp(const void *a, const void *b)
 {
-	struct entity *e = g_malloc(sizeof *e);
+	const struct entity *ea = a, *eb = b;
+	jint ax = CHUNK_XMASK(ea->pos.x), bx = CHUNK_XMASK(eb->pos.x);
+	if (ax != bx)
+		return ax < bx ? -1 : 1;
+	jint az = CHUNK_ZMASK(ea->pos.z), bz = CHUNK_ZMASK(eb->pos.z);
+	return az < bz ? -1 : az > bz;
+}
 
-	e->id = id;
-	e->type = type;
-	e->subtype = subtype;
-	e->name = name;
-	e->ax = x;
-	e->ay = y;
-	e->az = z;
+static struct entity_snapshot *entity_snapshot_new(void)
+{
+	struct entity_snapshot *snap = g_new(struct entity_snapshot, 1);
 
-	e->pos = COORD(x/32, z/32);
+	snap->nentities = g_hash_table_size(world_entities);
+	snap->entities = g_new(struct entity, snap->nentities);
 
-	G_LOCK(entity_mutex);
-	g_hash_table_replace(world_entities, &e->id, e);
-	G_UNLOCK(entity_mutex);
+	GHashTableIter entity_iter;
+	struct entity *e;
+	unsigned n = 0;
 
-	if (name)
+	g_hash_table_iter_init(&entity_iter, world_entities);
+	while (g_hash_table_iter_next(&entity_iter, NULL, (gpointer *) &e))
 	{
-		log_print("[INFO] Player appeared: %s", name);
-		map_repaint();
+		snap->entities[n] = *e;
+		snap->entities[n].name = e->name ? (unsigned char *) g_strdup((char *) e->name) : 0;
+		n++;
 	}
-}
 
-static void entity_del(jint id)
-{
-	if (id == entity_vehicle)
-	{
-		entity_vehicle = -1;
-		log_print("[INFO] Unmounted vehicle %d by destroying", id);
-	}
+	qsort(snap->entities, snap->nentities, sizeof *snap->entities, entity_chunk_cmp);
 
-	struct entity *e = g_hash_table_lookup(world_entities, &id);
+	/* one bucket for each run of entities in the same chunk */
 
-	/* Notch sometimes lies I guess */
-	if (!e) return;
+	snap->bucketv = g_new(struct entity_bucket, snap->nentities);
+	snap->nbuckets = 0;
+	snap->buckets = g_hash_table_new(coord_glib_hash, coord_glib_equal);
 
-	/* FIXME: This is ugly */
-	char *name = e->name ? g_strdup((char *) e->name) : 0;
+	for (unsigned i = 0; i < snap->nentities; i++)
+	{
+		coord_t key = COORD(CHUNK_XMASK(snap->entities[i].pos.x), CHUNK_ZMASK(snap->entities[i].pos.z));
+		struct entity_bucket *b = snap->nbuckets ? &snap->bucketv[snap->nbuckets-1] : 0;
 
-	G_LOCK(entity_mutex);
-	g_hash_table_remove(world_entities, &id);
+		if (b && coord_equal(b->key, key))
+		{
+			b->count++;
+			continue;
+		}
 
-	if (name)
-	{
-		log_print("[INFO] Player disappeared: %s", name);
-		g_free(name);
-		map_repaint();
+		b = &snap->bucketv[snap->nbuckets++];
+		b->key = key;
+		b->first = i;
+		b->count = 1;
+		g_hash_table_insert(snap->buckets, &b->key, b);
 	}
 
-	G_UNLOCK(entity_mutex);
+	return snap;
 }
 
-static void entity_move(jint id, jint x, jint y, jint z, int relative)
+static void entity_snapshot_free(gpointer sp)
 {
-	struct entity *e;
+	struct entity_snapshot *snap = sp;
+	for (unsigned i = 0; i < snap->nentities; i++)
+		g_free(snap->entities[i].name);
+	g_hash_table_unref(snap->buckets);
+	g_free(snap->bucketv);
+	g_free(snap->entities);
+	g_free(snap);
+}
 
-	e = g_hash_table_lookup(world_entities, &id);
+static void world_publish(void)
+{
+	gint epoch = g_atomic_int_get(&world_epoch);
+	bool published = false;
 
-	if (!e)
-		return;
+	if (edited_chunks->len)
+	{
+		for (unsigned i = 0; i < edited_chunks->len; i++)
+		{
+			coord_t cc = g_array_index(edited_chunks, coord_t, i);
+			struct region *region = world_region(cc, false);
+			jint xo = CHUNK_XIDX(REGION_XOFF(cc.x)), zo = CHUNK_ZIDX(REGION_ZOFF(cc.z));
 
-	if (relative)
+			struct chunk *old = region->chunks[xo][zo];
+			g_atomic_pointer_set((volatile gpointer *) &region->chunks[xo][zo], region->edits[xo][zo]);
+			region->edits[xo][zo] = 0;
+
+			if (old)
+				world_retire(old, g_free, epoch);
+
+			chunk_touch(region, xo, zo);
+		}
+
+		g_array_set_size(edited_chunks, 0);
+		published = true;
+	}
+
+	for (unsigned i = 0; i < chunk_unloads->len; i++)
 	{
-		e->ax += x;
-		e->ay += y;
-		e->az += z;
+		coord_t cc = g_array_index(chunk_unloads, coord_t, i);
+		if (chunk_evict(cc, epoch))
+			published = true;
+		else if (!chunk_saved(cc))
+			continue; /* keep it around until it has been written */
+		g_array_remove_index_fast(chunk_unloads, i--);
 	}
-	else
+
+	if (chunk_budget && loaded_chunks > chunk_budget)
 	{
-		e->ax = x;
-		e->ay = y;
-		e->az = z;
+		/* least recently used first, skipping those not written out yet */
+		for (GList *link = chunk_lru.tail, *prev; link && loaded_chunks > chunk_budget; link = prev)
+		{
+			prev = link->prev;
+			if (chunk_evict(*(coord_t *) link->data, epoch))
+				published = true;
+		}
 	}
 
-	coord_t ep = COORD(e->ax/32, e->az/32);
-	if (coord_equal(e->pos, ep))
-		return;
+	if (entities_changed)
+	{
+		struct entity_snapshot *old = entity_snapshot;
+		g_atomic_pointer_set((volatile gpointer *) &entity_snapshot, entity_snapshot_new());
+		if (old)
+			world_retire(old, entity_snapshot_free, epoch);
 
-	e->pos = ep;
+		entities_changed = false;
+		published = true;
 
-	if (id == entity_vehicle)
-		update_player_pos(ep.x, e->ay/32, ep.z);
-	else
 		map_repaint();
-}
+	}
+
+	if (published)
+	{
+		/* 0 marks a free reader slot, so skip it on wrap-around */
+		epoch = (gint)((guint)epoch + 1);
+		g_atomic_int_set(&world_epoch, epoch ? epoch : 1);
+	}
+
+	world_reclaim();
+
+	GHashTableIter update_iter;
+	struct column_update *u;
+
+	g_hash_table_iter_init(&update_iter, map_updates);
+	while (g_hash_table_iter_next(&update_iter, NULL, (gpointer *) &u))
+		map_update_columns(u->key, u->columns);
+	g_hash_table_remove_all(map_updates);
+
+	wal_commit();
+
+	if (g_atomic_int_compare_and_exchange(&save_requested, 1, 0))
+		persist_now = true;
+
+	if (region_path && g_hash_table_size(unsaved)
+	    && (persist_now || g_hash_table_size(unsaved) >= PERSIST_BATCH || g_timer_elapsed(persist_timer, 0) >= PERSIST_INTERVAL))
+		world_persist();
+}
+
+int world_snapshot_begin(void)
+{
+	while (1)
+	{
+		gint epoch = g_atomic_int_get(&world_epoch);
+
+		for (int i = 0; i < SNAPSHOT_SLOTS; i++)
+		{
+			if (!g_atomic_int_compare_and_exchange(&snapshot_readers[i], 0, epoch))
+				continue;
+
+			/* the epoch may have moved on before the slot became visible */
+			gint now;
+			while ((now = g_atomic_int_get(&world_epoch)) != epoch)
+				g_atomic_int_set(&snapshot_readers[i], epoch = now);
+
+			return i;
+		}
+
+		g_thread_yield();
+	}
+}
+
+void world_snapshot_end(int snap)
+{
+	g_atomic_int_set(&snapshot_readers[snap], 0);
+}
+
+void world_snapshot_entities(coord_t c1, coord_t c2, void (*func)(struct entity *e, void *userdata), void *userdata)
+{
+	struct entity_snapshot *snap = g_atomic_pointer_get((volatile gpointer *) &entity_snapshot);
+
+	if (!snap)
+		return;
+
+	coord_t k1 = COORD(CHUNK_XMASK(c1.x), CHUNK_ZMASK(c1.z));
+	coord_t k2 = COORD(CHUNK_XMASK(c2.x), CHUNK_ZMASK(c2.z));
+
+	guint64 area = (guint64)((k2.x - k1.x)/CHUNK_XSIZE + 1) * ((k2.z - k1.z)/CHUNK_ZSIZE + 1);
+
+	if (area > snap->nbuckets)
+	{
+		/* more chunks in view than non-empty buckets; just test them all */
+		for (unsigned i = 0; i < snap->nbuckets; i++)
+		{
+			struct entity_bucket *b = &snap->bucketv[i];
+			if (b->key.x < k1.x || b->key.x > k2.x || b->key.z < k1.z || b->key.z > k2.z)
+				continue;
+			for (unsigned j = 0; j < b->count; j++)
+				func(&snap->entities[b->first + j], userdata);
+		}
+		return;
+	}
+
+	for (jint cz = k1.z; cz <= k2.z; cz += CHUNK_ZSIZE)
+	{
+		for (jint cx = k1.x; cx <= k2.x; cx += CHUNK_XSIZE)
+		{
+			coord_t key = COORD(cx, cz);
+			struct entity_bucket *b = g_hash_table_lookup(snap->buckets, &key);
+			if (!b)
+				continue;
+			for (unsigned j = 0; j < b->count; j++)
+				func(&snap->entities[b->first + j], userdata);
+		}
+	}
+}
+
+static struct region *snapshot_region(coord_t cc)
+{
+	coord_t rc = COORD(REGION_XMASK(cc.x), REGION_ZMASK(cc.z));
+
+	G_LOCK(region_mutex);
+	struct region *region = g_hash_table_lookup(region_table, &rc);
+	G_UNLOCK(region_mutex);
+
+	return region;
+}
+
+bool world_region_exists(coord_t cc)
+{
+	return snapshot_region(cc) != 0;
+}
+
+gint world_chunk_version(coord_t cc)
+{
+	struct region *region = snapshot_region(cc);
+
+	if (!region)
+		return 0;
+
+	jint xo = CHUNK_XIDX(REGION_XOFF(cc.x)), zo = CHUNK_ZIDX(REGION_ZOFF(cc.z));
+	return g_atomic_int_get(&region->versions[zo*REGION_SIZE+xo]);
+}
+
+bool world_chunk_evicted(coord_t cc)
+{
+	struct region *region = snapshot_region(cc);
+
+	if (!region)
+		return false;
+
+	jint xo = CHUNK_XIDX(REGION_XOFF(cc.x)), zo = CHUNK_ZIDX(REGION_ZOFF(cc.z));
+	return BITSET_TEST(region->evicted, zo*REGION_SIZE+xo);
+}
+
+void world_request_chunk(coord_t cc)
+{
+	coord_t *key = g_new(coord_t, 1);
+	*key = cc;
+	g_async_queue_push(requestq, key);
+}
+
+struct chunk *world_snapshot_chunk(coord_t cc)
+{
+	struct region *region = snapshot_region(cc);
+
+	if (!region)
+		return 0;
+
+	jint xo = CHUNK_XIDX(REGION_XOFF(cc.x)), zo = CHUNK_ZIDX(REGION_ZOFF(cc.z));
+	return g_atomic_pointer_get((volatile gpointer *) &region->chunks[xo][zo]);
+}
+
+unsigned char *world_stack(coord_t cc, bool gen)
+{
+	struct chunk *c = world_chunk(cc, gen);
+	if (!c)
+		return 0;
+
+	return c->blocks[CHUNK_XOFF(cc.x)][CHUNK_ZOFF(cc.z)];
+}
+
+jint world_getheight(coord_t cc)
+{
+	struct chunk *c = world_chunk(cc, false);
+	if (!c)
+		return -1;
+
+	return c->height[CHUNK_XOFF(cc.x)][CHUNK_ZOFF(cc.z)];
+}
+
+static bool handle_compressed_chunk(jint x0, jint y0, jint z0,
+                                    jint xs, jint ys, jint zs,
+                                    unsigned zlen, unsigned char *zdata,
+                                    bool update_map)
+{
+	static unsigned char zbuf[256*1024];
+	int err;
+
+	wal_chunk(x0, y0, z0, xs, ys, zs, zlen, zdata);
+
+	z_stream zstr = {
+		.next_in = zdata,
+		.avail_in = zlen,
+		.next_out = zbuf,
+		.avail_out = sizeof zbuf
+	};
+
+	if ((err = inflateInit(&zstr)) != Z_OK)
+	{
+		log_print("[WHAT] chunk update decompression: inflateInit: %s", zError(err));
+		return false;
+	}
+
+	while (zstr.avail_in)
+	{
+		err = inflate(&zstr, Z_PARTIAL_FLUSH);
+		if (err != Z_OK && err != Z_STREAM_END)
+		{
+			log_print("[WHAT] chunk update decompression: inflate: %s", zError(err));
+			return false;
+		}
+		if (err == Z_STREAM_END)
+			break;
+	}
+
+	int zbuf_len = (sizeof zbuf) - zstr.avail_out;
+	inflateEnd(&zstr);
+
+	if (zbuf_len < xs*ys*zs)
+	{
+		log_print("[WHAT] broken decompressed chunk length: %d != %d and < %d",
+		      (int)zbuf_len, (int)(5*xs*ys*zs+1)/2, xs*ys*zs);
+		return false;
+	}
+
+	if (y0 > CHUNK_YSIZE)
+	{
+		log_print("[WHAT] too high chunk update: %d..%d", y0, y0+ys-1);
+		return false;
+	}
+	else if (y0 + ys > CHUNK_YSIZE)
+		ys = CHUNK_YSIZE - y0;
+
+	// FIXME: These lengths are too big, because they include the buffers after them.
+	// Not really a problem, though.
+	struct buffer zb = { zbuf_len, zbuf };
+#ifdef FEAT_FULLCHUNK
+	struct buffer zb_meta = offset_buffer(zb, xs*ys*zs);
+	struct buffer zb_light_blocks = offset_buffer(zb_meta, (xs*ys*zs+1)/2);
+	struct buffer zb_light_sky = offset_buffer(zb_light_blocks, (xs*ys*zs+1)/2);
+#else
+	struct buffer zb_meta = { 0, 0 };
+	struct buffer zb_light_blocks = { 0, 0 };
+	struct buffer zb_light_sky = { 0, 0 };
+#endif
+	return world_handle_chunk(x0, y0, z0, xs, ys, zs, zb, zb_meta, zb_light_blocks, zb_light_sky, update_map);
+}
+
+/* update the per-column height maps after blocks [y0, y1] have changed */
+
+static bool update_heights(struct chunk *c, jint x, jint z, jint y0, jint y1)
+{
+	unsigned char *stack = c->blocks[x][z];
+	bool changed = false;
+
+	jint h = c->height[x][z];
+	if (y1 >= h)
+	{
+		jint newh = y1;
+		while (!stack[newh] && newh > 0)
+			newh--;
+		if (newh != h)
+			changed = true;
+		c->height[x][z] = h = newh;
+	}
+
+	jint hs = c->height_solid[x][z];
+	if (y1 >= hs)
+	{
+		jint newhs = y1;
+		while (IS_HOLLOW(stack[newhs]) && newhs > 0)
+			newhs--;
+		if (newhs != hs)
+			changed = true;
+		c->height_solid[x][z] = newhs;
+	}
+
+	/* the water depth only changes if the edit reaches the topmost water column */
+
+	if (changed || y1 >= h - c->water_depth[x][z])
+	{
+		jint depth = 0;
+		for (jint y = h; y >= 0 && IS_WATER(stack[y]); y--)
+			depth++;
+		if (depth != c->water_depth[x][z])
+			changed = true;
+		c->water_depth[x][z] = depth;
+	}
+
+	return changed;
+}
+
+bool world_handle_chunk(jint x0, jint y0, jint z0,
+                            jint xs, jint ys, jint zs,
+                            struct buffer zb, struct buffer zb_meta,
+                            struct buffer zb_light_blocks, struct buffer zb_light_sky,
+                            bool update_map)
+{
+	bool set_chunk = false;
+	coord_t current_chunk = COORD(0, 0);
+	struct chunk *c = 0;
+	uint8_t *columns = 0;
+
+	if (ys < 0)
+	{
+		log_print("[WARN] Invalid chunk size! Probably WorldEdit; go yell at the author.");
+		return false;
+	}
+
+	bool changed = false;
+
+	for (jint x = x0; x < x0+xs; x++)
+	{
+		for (jint z = z0; z < z0+zs; z++)
+		{
+			coord_t cc = COORD(CHUNK_XMASK(x), CHUNK_ZMASK(z));
+
+			if (!coord_equal(cc, current_chunk) || !set_chunk)
+			{
+				set_chunk = true;
+				c = world_chunk_edit(cc, true);
+				current_chunk = cc;
+				columns = 0;
+			}
+
+			bool column_changed = memcmp(&c->blocks[CHUNK_XOFF(x)][CHUNK_ZOFF(z)][y0], zb.data, ys) != 0;
+
+			memcpy(&c->blocks[CHUNK_XOFF(x)][CHUNK_ZOFF(z)][y0], zb.data, ys);
+			ADVANCE_BUFFER(zb, ys);
+
+#ifdef FEAT_FULLCHUNK
+			size_t bytes = (ys+1)/2;
+
+			if (bytes <= zb_meta.len)
+			{
+				memcpy(&c->meta[(CHUNK_XOFF(x)*CHUNK_ZSIZE + CHUNK_ZOFF(z))*(CHUNK_YSIZE/2) + y0/2], zb_meta.data, bytes);
+				ADVANCE_BUFFER(zb_meta, bytes);
+			}
+
+			if (bytes <= zb_light_blocks.len)
+			{
+				memcpy(&c->light_blocks[(CHUNK_XOFF(x)*CHUNK_ZSIZE + CHUNK_ZOFF(z))*(CHUNK_YSIZE/2) + y0/2], zb_light_blocks.data, bytes);
+				ADVANCE_BUFFER(zb_light_blocks, (ys+1)/2);
+			}
+
+			if (bytes <= zb_light_sky.len)
+			{
+				memcpy(&c->light_sky[(CHUNK_XOFF(x)*CHUNK_ZSIZE + CHUNK_ZOFF(z))*(CHUNK_YSIZE/2) + y0/2], zb_light_sky.data, bytes);
+				ADVANCE_BUFFER(zb_light_sky, (ys+1)/2);
+			}
+#endif
+
+			if (ys > 0 && update_heights(c, CHUNK_XOFF(x), CHUNK_ZOFF(z), y0, y0+ys-1))
+				column_changed = true;
+
+			if (column_changed)
+			{
+				changed = true;
+				if (update_map)
+				{
+					/* only chunks with a changed column get an update */
+					if (!columns)
+						columns = world_map_columns(cc);
+					BITSET_SET(columns, CHUNK_ZOFF(z)*CHUNK_XSIZE + CHUNK_XOFF(x));
+				}
+			}
+		}
+	}
+
+	return changed;
+}
+
+static inline int block_change(struct chunk *c, jint x, jint y, jint z, unsigned char type)
+{
+	if (y < 0 || y >= CHUNK_YSIZE)
+		return 0; /* sometimes server sends Y=CHUNK_YSIZE block-to-air "updates" */
+
+	int changed = (c->blocks[x][z][y] != type);
+	c->blocks[x][z][y] = type;
+
+	if (update_heights(c, x, z, y, y))
+		changed = 1;
+
+	return changed;
+}
+
+static void handle_multi_set_block(jint cx, jint cz, jint size, unsigned char *coord, unsigned char *type)
+{
+	coord_t cc = COORD(cx * CHUNK_XSIZE, cz * CHUNK_ZSIZE);
+	struct chunk *c = world_chunk_edit(cc, false);
+	if (!c)
+		return; /* edit in an unloaded chunk */
+
+	uint8_t *columns = 0;
+
+	while (size--)
+	{
+		int x = coord[0] >> 4, y = coord[1], z = coord[0] & 0x0f;
+		coord += 2;
+		wal_block(cc.x + x, y, cc.z + z, *type);
+		if (!block_change(c, x, y, z, *type++))
+			continue;
+		if (!columns)
+			columns = world_map_columns(cc);
+		BITSET_SET(columns, z*CHUNK_XSIZE + x);
+	}
+}
+
+static void handle_set_block(jint x, jint y, jint z, jint type)
+{	
+	coord_t cc = COORD(x, z);
+	struct chunk *c = world_chunk_edit(cc, false);
+	if (!c)
+		return; /* edit in an unloaded chunk */
+
+	wal_block(x, y, z, type);
+
+	if (block_change(c, CHUNK_XOFF(x), y, CHUNK_ZOFF(z), type))
+		BITSET_SET(world_map_columns(cc), CHUNK_ZOFF(z)*CHUNK_XSIZE + CHUNK_XOFF(x));
+}
+
+static gint wal_segment_cmp(gconstpointer a, gconstpointer b)
+{
+	unsigned sa = *(const unsigned *)a, sb = *(const unsigned *)b;
+	return sa < sb ? -1 : sa > sb;
+}
+
+/* write-ahead log: the world thread appends every block change and chunk
+   update it handles, and hands the records over at each publish; the WAL
+   thread writes and fsyncs whatever has queued up meanwhile at once.
+   The log is cut into segments at each persist hand-off, and segments are
+   deleted once the region files hold (durably) everything in them. */
+
+static char *wal_segment_path(unsigned seg)
+{
+	return g_strdup_printf("%s/wal.%u", world_path, seg);
+}
+
+static GArray *wal_segments(void)
+{
+	/* existing segment numbers, in order */
+
+	GArray *segs = g_array_new(false, false, sizeof(unsigned));
+
+	GError *error = 0;
+	GDir *dir = g_dir_open(world_path, 0, &error);
+	if (!dir)
+		dief("unable to scan world directory contents: %s", error->message);
+
+	const char *name;
+	while ((name = g_dir_read_name(dir)))
+	{
+		unsigned seg;
+		char end;
+		if (sscanf(name, "wal.%u%c", &seg, &end) == 1)
+			g_array_append_val(segs, seg);
+	}
+
+	g_dir_close(dir);
+
+	g_array_sort(segs, wal_segment_cmp);
+	return segs;
+}
+
+static void wal_append(const unsigned char *rec, size_t len, const unsigned char *data, size_t datalen)
+{
+	if (!wal_pending)
+		return; /* not persistent, or replaying */
+
+	uLong crc = crc32(0, rec, len);
+	g_byte_array_append(wal_pending, rec, len);
+	if (datalen)
+	{
+		crc = crc32(crc, data, datalen);
+		g_byte_array_append(wal_pending, data, datalen);
+	}
+
+	unsigned char sum[4];
+	jint_write(sum, (guint32)crc);
+	g_byte_array_append(wal_pending, sum, sizeof sum);
+}
+
+static void wal_block(jint x, jint y, jint z, jint type)
+{
+	unsigned char rec[11];
+	rec[0] = WAL_BLOCK;
+	jint_write(rec+1, x);
+	rec[5] = y;
+	jint_write(rec+6, z);
+	rec[10] = type;
+	wal_append(rec, sizeof rec, 0, 0);
+}
+
+static void wal_chunk(jint x0, jint y0, jint z0, jint xs, jint ys, jint zs, unsigned zlen, unsigned char *zdata)
+{
+	/* the compressed update as it came from the server */
+
+	unsigned char rec[18];
+	rec[0] = WAL_CHUNK;
+	jint_write(rec+1, x0);
+	jshort_write(rec+5, y0);
+	jint_write(rec+7, z0);
+	rec[11] = xs-1;
+	rec[12] = ys-1;
+	rec[13] = zs-1;
+	jint_write(rec+14, zlen);
+	wal_append(rec, sizeof rec, zdata, zlen);
+}
+
+static void wal_commit(void)
+{
+	if (!wal_pending || !wal_pending->len)
+		return;
+
+	struct wal_msg *msg = g_new(struct wal_msg, 1);
+	msg->seg = wal_seg;
+	msg->records = wal_pending;
+	g_async_queue_push(walq, msg);
+
+	wal_pending = g_byte_array_new();
+}
+
+static void wal_drop(unsigned seg)
+{
+	/* everything up to and including segment seg is in the region files */
+
+	struct wal_msg *msg = g_new(struct wal_msg, 1);
+	msg->seg = seg;
+	msg->records = 0;
+	g_async_queue_push(walq, msg);
+}
+
+static unsigned wal_replay(void)
+{
+	/* redo everything logged but not known to be in the region files */
+
+	GArray *segs = wal_segments();
+	unsigned nrecs = 0;
+	bool damaged = false;
+
+	for (unsigned i = 0; i < segs->len; i++)
+	{
+		unsigned seg = g_array_index(segs, unsigned, i);
+		if (seg >= wal_seg)
+			wal_seg = seg + 1;
+
+		char *path = wal_segment_path(seg);
+		gchar *contents;
+		gsize len;
+		GError *error = 0;
+
+		if (damaged)
+		{
+			/* not replayed, so it must not be replayed after newer records either */
+			g_unlink(path);
+			g_free(path);
+			continue;
+		}
+
+		if (!g_file_get_contents(path, &contents, &len, &error))
+			dief("unable to read write-ahead log: %s", error->message);
+
+		unsigned char *p = (unsigned char *) contents, *end = p + len;
+
+		/* the updates build on each other, so nothing after a torn or
+		   damaged record can be used, not even in later segments */
+
+		while (p < end)
+		{
+			size_t rlen = 0;
+			if (p[0] == WAL_BLOCK)
+				rlen = 11;
+			else if (p[0] == WAL_CHUNK && end - p >= 18 && (size_t)(end - p - 18) >= (guint32)jint_read(p+14))
+				rlen = 18 + (guint32)jint_read(p+14);
+
+			if (!rlen || (size_t)(end - p) < rlen + 4 || crc32(0, p, rlen) != (guint32)jint_read(p + rlen))
+			{
+				log_print("[WARN] Ignoring write-ahead log from a torn or damaged record on: %s", path);
+				damaged = true;
+
+				/* keep only what was replayed */
+				int fd = open(path, O_WRONLY);
+				if (fd == -1 || ftruncate(fd, p - (unsigned char *) contents) != 0 || sync_file(fd) != 0)
+					dief("unable to truncate write-ahead log: %s: %s", path, g_strerror(errno));
+				close(fd);
+				break;
+			}
+
+			if (p[0] == WAL_BLOCK)
+				handle_set_block(jint_read(p+1), p[5], jint_read(p+6), p[10]);
+			else
+				handle_compressed_chunk(jint_read(p+1), jshort_read(p+5), jint_read(p+7),
+				                        p[11]+1, p[12]+1, p[13]+1, rlen - 18, p+18, true);
+
+			p += rlen + 4;
+			nrecs++;
+		}
+
+		g_free(contents);
+		g_free(path);
+	}
+
+	if (damaged && sync_dir(world_path) != 0)
+		dief("IO error when syncing world directory: %s: %s", world_path, g_strerror(errno));
+
+	g_array_free(segs, true);
+	return nrecs;
+}
+
+static gpointer wal_thread(gpointer data)
+{
+	int fd = -1;
+	unsigned seg = 0;
+
+	while (1)
+	{
+		struct wal_msg *msg = g_async_queue_pop(walq);
+		bool written = false;
+
+		/* group commit: everything queued up while the last fsync ran */
+
+		do
+		{
+			if (msg->records)
+			{
+				if (fd == -1 || msg->seg != seg)
+				{
+					if (fd != -1 && (sync_file(fd) != 0 || close(fd) != 0))
+						dief("IO error when closing write-ahead log: %s", g_strerror(errno));
+
+					seg = msg->seg;
+					char *path = wal_segment_path(seg);
+					fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0666);
+					if (fd == -1)
+						dief("unable to open write-ahead log: %s: %s", path, g_strerror(errno));
+					g_free(path);
+
+					/* or syncing the records would not keep the segment itself */
+					if (sync_dir(world_path) != 0)
+						dief("IO error when syncing world directory: %s: %s", world_path, g_strerror(errno));
+				}
+
+				if (write(fd, msg->records->data, msg->records->len) != msg->records->len)
+					dief("IO error when writing write-ahead log: %s", g_strerror(errno));
+
+				g_byte_array_unref(msg->records);
+				written = true;
+			}
+			else
+			{
+				GArray *segs = wal_segments();
+				for (unsigned i = 0; i < segs->len && g_array_index(segs, unsigned, i) <= msg->seg; i++)
+				{
+					char *path = wal_segment_path(g_array_index(segs, unsigned, i));
+					g_unlink(path);
+					g_free(path);
+				}
+				g_array_free(segs, true);
+			}
+
+			g_free(msg);
+		} while ((msg = g_async_queue_try_pop(walq)));
+
+		if (written && sync_file(fd) != 0)
+			dief("IO error when syncing write-ahead log: %s", g_strerror(errno));
+	}
+
+	return 0;
+}
+
+static void update_player_pos(double x, double y, double z)
+{
+	coord3_t new_pos = COORD3(floor(x), floor(y), floor(z));
+
+	if (coord3_equal(player_pos, new_pos))
+		return;
+
+	if (CHUNK_XMASK(new_pos.x) != CHUNK_XMASK(player_pos.x) || CHUNK_ZMASK(new_pos.z) != CHUNK_ZMASK(player_pos.z))
+		chunk_load_around(new_pos);
+
+	player_pos = new_pos;
+
+	map_mode->update_player_pos(map_mode->data);
+	map_repaint();
+}
+
+static void update_player_dir(double yaw)
+{
+	int new_yaw = 0;
+
+	yaw = fmod(yaw, 360.0);
+
+	if (yaw < 0.0) yaw += 360.0;
+	if (yaw > 360-22.5) yaw -= 360;
+
+	while (new_yaw < 7 && yaw > 22.5)
+		new_yaw++, yaw -= 45.0;
+
+	if (new_yaw == player_yaw)
+		return;
+
+	player_yaw = new_yaw;
+
+	map_repaint();
+}
+
+static void entity_add(jint id, enum entity_type type, jshort subtype,
+                       unsigned char *name, jint x, jint y, jint z)
+{
+	struct entity *e = g_malloc(sizeof *e);
+
+	e->id = id;
+	e->type = type;
+	e->subtype = subtype;
+	e->name = name;
+	e->ax = x;
+	e->ay = y;
+	e->az = z;
+
+	e->pos = COORD(x/32, z/32);
+
+	g_hash_table_replace(world_entities, &e->id, e);
+	entities_changed = true;
+
+	if (name)
+		log_print("[INFO] Player appeared: %s", name);
+}
+
+static void entity_del(jint id)
+{
+	if (id == entity_vehicle)
+	{
+		entity_vehicle = -1;
+		log_print("[INFO] Unmounted vehicle %d by destroying", id);
+	}
+
+	struct entity *e = g_hash_table_lookup(world_entities, &id);
+
+	/* Notch sometimes lies I guess */
+	if (!e) return;
+
+	if (e->name)
+		log_print("[INFO] Player disappeared: %s", e->name);
+
+	g_hash_table_remove(world_entities, &id);
+	entities_changed = true;
+}
+
+static void entity_move(jint id, jint x, jint y, jint z, int relative)
+{
+	struct entity *e;
+
+	e = g_hash_table_lookup(world_entities, &id);
+
+	if (!e)
+		return;
+
+	if (relative)
+	{
+		e->ax += x;
+		e->ay += y;
+		e->az += z;
+	}
+	else
+	{
+		e->ax = x;
+		e->ay = y;
+		e->az = z;
+	}
+
+	coord_t ep = COORD(e->ax/32, e->az/32);
+	if (coord_equal(e->pos, ep))
+		return;
+
+	e->pos = ep;
+	entities_changed = true;
+
+	if (id == entity_vehicle)
+		update_player_pos(ep.x, e->ay/32, ep.z);
+}
 
 static gpointer world_thread(gpointer data)
 {
-	while (1)
+	unsigned batch = 0;
+
+	while (1)
+	{
+		GTimeVal timeout;
+		g_get_current_time(&timeout);
+		g_time_val_add(&timeout, g_hash_table_size(pending_loads) ? WORLD_LOAD_USEC : WORLD_IDLE_USEC);
+
+		struct directed_packet *dpacket = g_async_queue_timed_pop(worldq, &timeout);
+
+		if (!dpacket)
+		{
+			chunk_handle_requests();
+			world_publish();
+			batch = 0;
+			continue;
+		}
+
+		enum packet_origin from = dpacket->from;
+		packet_t *packet = dpacket->p;
+		g_free(dpacket);
+
+		struct buffer msg;
+		coord_t cc;
+		unsigned char *p;
+		jint t;
+		jlong tl;
+
+		switch (packet->type)
+		{
+		case PACKET_PRE_CHUNK:
+			cc = COORD(packet_int(packet, 0) * CHUNK_XSIZE, packet_int(packet, 1) * CHUNK_ZSIZE);
+			if (packet_int(packet, 2) == 0)
+				g_array_append_val(chunk_unloads, cc);
+			else
+			{
+				/* loaded again before the unload was acted upon */
+				for (unsigned i = 0; i < chunk_unloads->len; i++)
+					if (coord_equal(g_array_index(chunk_unloads, coord_t, i), cc))
+						g_array_remove_index_fast(chunk_unloads, i--);
+			}
+			break;
+
+		case PACKET_MAP_CHUNK:
+			p = &packet->bytes[packet->field_offset[6]];
+			handle_compressed_chunk(packet_int(packet, 0), packet_int(packet, 1), packet_int(packet, 2),
+			                        packet_int(packet, 3)+1, packet_int(packet, 4)+1, packet_int(packet, 5)+1,
+			                        (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3], &p[4], true);
+			break;
+
+		case PACKET_MULTI_BLOCK_CHANGE:
+			p = &packet->bytes[packet->field_offset[2]];
+			t = (p[0] << 8) | p[1];
+			handle_multi_set_block(packet_int(packet, 0), packet_int(packet, 1),
+			                       t, p+2, p+2+t*2);
+			break;
+
+		case PACKET_BLOCK_CHANGE:
+			handle_set_block(packet_int(packet, 0),
+			                 packet_int(packet, 1),
+			                 packet_int(packet, 2),
+			                 packet_int(packet, 3));
+			break;
+
+		case PACKET_LOGIN_REQUEST:
+			if (from == PACKET_FROM_SERVER)
+			{
+				entity_player = packet_int(packet, 0);
+				world_seed = packet_long(packet, 3);
+			}
+			break;
+
+		case PACKET_PLAYER_LOOK:
+			update_player_dir(packet_double(packet, 0));
+			break;
+
+		case PACKET_PLAYER_POSITION_AND_LOOK:
+			update_player_dir(packet_double(packet, 4));
+
+			/* fall-thru to PACKET_PLAYER_POSITION */
+
+		case PACKET_PLAYER_POSITION:
+			if (entity_vehicle < 0)
+				update_player_pos(packet_double(packet, 0),
+				                  packet_double(packet, 1),
+				                  packet_double(packet, 3));
+
+			if (from == PACKET_FROM_SERVER && !spawn_known)
+			{
+				spawn_known = true;
+				spawn_x = packet_double(packet, 0);
+				spawn_y = packet_double(packet, 1);
+				spawn_z = packet_double(packet, 3);
+			}
+
+			break;
+
+
+		case PACKET_NAMED_ENTITY_SPAWN:
+			entity_add(packet_int(packet, 0),
+			           ENTITY_PLAYER,
+			           0,
+			           packet_string(packet, 1).data,
+			           packet_int(packet, 2),
+			           packet_int(packet, 3),
+			           packet_int(packet, 4));
+			break;
+
+		case PACKET_PICKUP_SPAWN:
+			entity_add(packet_int(packet, 0),
+			           ENTITY_PICKUP,
+			           packet_int(packet, 1),
+			           0,
+			           packet_int(packet, 4),
+			           packet_int(packet, 5),
+			           packet_int(packet, 6));
+			break;
+
+		case PACKET_MOB_SPAWN:
+			entity_add(packet_int(packet, 0),
+			           ENTITY_MOB,
+			           packet_int(packet, 1),
+			           0,
+			           packet_int(packet, 2),
+			           packet_int(packet, 3),
+			           packet_int(packet, 4));
+			break;
+
+		case PACKET_DESTROY_ENTITY:
+			entity_del(packet_int(packet, 0));
+			break;
+
+		case PACKET_ENTITY_RELATIVE_MOVE:
+		case PACKET_ENTITY_LOOK_AND_RELATIVE_MOVE:
+			entity_move(packet_int(packet, 0),
+			            packet_int(packet, 1),
+			            packet_int(packet, 2),
+			            packet_int(packet, 3),
+			            1);
+			break;
+
+		case PACKET_ENTITY_TELEPORT:
+			entity_move(packet_int(packet, 0),
+			            packet_int(packet, 1),
+			            packet_int(packet, 2),
+			            packet_int(packet, 3),
+			            0);
+			break;
+
+		case PACKET_ATTACH_ENTITY:
+			if (packet_int(packet, 0) == entity_player)
+			{
+				jint new_vehicle = packet_int(packet, 1);
+				if (new_vehicle < 0)
+					log_print("[INFO] Unmounted vehicle %d normally", entity_vehicle);
+				else
+					log_print("[INFO] Mounted vehicle %d", new_vehicle);
+				entity_vehicle = packet_int(packet, 1);
+			}
+			break;
+
+		case PACKET_TIME_UPDATE:
+			tl = packet_long(packet, 0);
+			tl %= 24000;
+			world_time = tl;
+			map_mode->update_time(map_mode->data);
+			break;
+
+		case PACKET_UPDATE_HEALTH:
+			player_health = packet_int(packet, 0);
+			break;
+
+		case PACKET_CHAT_MESSAGE:
+			msg = packet_string(packet, 0);
+			if (msg.len >= 3 && msg.data[0] == '/' && msg.data[1] == '/')
+			{
+				struct buffer cmd = offset_buffer(msg, 2);
+				cmd_parse(cmd);
+			}
+			g_free(msg.data);
+			break;
+		}
+
+		packet_free(packet);
+
+		/* make edits visible once the queue drains, or periodically under load */
+
+		if (++batch >= WORLD_BATCH || g_async_queue_length(worldq) <= 0)
+		{
+			chunk_handle_requests();
+			world_publish();
+			batch = 0;
+		}
+	}
+
+	return NULL;
+}
+
+/* world file IO routines */
+
+void world_flush(void)
+{
+	/* picked up by the world thread when it next publishes */
+	g_atomic_int_set(&save_requested, 1);
+}
+
+#define SECTOR_SIZE 4096
+
+static const char base36_chars[36] = "0123456789abcdefghijklmnopqrstuvwxyz";
+
+static char *base36_encode(jint value, char *buf, int bufsize)
+{
+	buf[bufsize-1] = 0;
+	bufsize -= 2;
+
+	int neg = 0;
+
+	if (value < 0)
+		neg = 1, value = -value;
+	else if (value == 0)
+	{
+		buf[bufsize] = '0';
+		return buf+bufsize;
+	}
+
+	while (value && bufsize >= 0)
+	{
+		buf[bufsize--] = base36_chars[value % 36];
+		value /= 36;
+	}
+
+	if (neg && bufsize >= 0)
+		buf[bufsize--] = '-';
+
+	return buf + bufsize + 1;
+}
+
+static guint64 chunk_hash(struct chunk *c)
+{
+	/* 64-bit multiply-xorshift over the stored arrays, a word at a time */
+
+	const unsigned char *arrays[] = {
+		&c->blocks[0][0][0],
+#ifdef FEAT_FULLCHUNK
+		c->meta, c->light_blocks, c->light_sky,
+#endif
+	};
+	const size_t sizes[] = {
+		CHUNK_NBLOCKS,
+#ifdef FEAT_FULLCHUNK
+		CHUNK_NBLOCKS/2, CHUNK_NBLOCKS/2, CHUNK_NBLOCKS/2,
+#endif
+	};
+
+	guint64 h = G_GUINT64_CONSTANT(0xcbf29ce484222325);
+
+	for (size_t a = 0; a < NELEMS(arrays); a++)
+	{
+		for (size_t i = 0; i < sizes[a]; i += 8)
+		{
+			guint64 w;
+			memcpy(&w, arrays[a] + i, 8);
+			h = (h ^ w) * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15);
+			h ^= h >> 29;
+		}
+	}
+
+	return h ? h : 1; /* 0 means unknown */
+}
+
+static struct buffer compress_chunk(struct chunk *c, int level, size_t *rawlen)
+{
+	/* stream the chunk data into compressed NBT, straight from the chunk */
+
+	struct nbt_writer *w = nbt_writer_new(level);
+
+	nbt_write_struct(w, "Level");
+
+	nbt_write_blob(w, "Blocks", c->blocks, CHUNK_NBLOCKS);
+#ifdef FEAT_FULLCHUNK
+	nbt_write_blob(w, "Data", c->meta, CHUNK_NBLOCKS/2);
+	nbt_write_blob(w, "BlockLight", c->light_blocks, CHUNK_NBLOCKS/2);
+	nbt_write_blob(w, "SkyLight", c->light_sky, CHUNK_NBLOCKS/2);
+	nbt_write_blob(w, "HeightMap", c->height, CHUNK_XSIZE*CHUNK_ZSIZE); /* TODO FIXME: indexing X/Z */
+#endif /* FEAT_FULLCHUNK */
+
+	/* TODO: Entities, TileEntities */
+
+	nbt_write_long(w, "LastUpdate", 0);
+
+	nbt_write_int(w, "xPos", NBT_TAG_INT, c->key.x);
+	nbt_write_int(w, "zPos", NBT_TAG_INT, c->key.z);
+
+	nbt_write_int(w, "TerrainPopulated", NBT_TAG_BYTE, 1);
+
+	nbt_write_end(w);
+
+	return nbt_writer_finish(w, rawlen);
+}
+
+static void ensure_regfile(struct region *region)
+{
+	if (region->file && !region->file->contents)
+	{
+		/* only indexed so far */
+		if (!region->file->header)
+			regfile_read_header(region->file);
+		regfile_map(region->file);
+	}
+	else if (region_path && !region->file)
+	{
+		/* not loaded from disk, so assume new file */
+		/* open/create, and flag all existing chunks in region as dirty */
+
+		char file_x_buf[16], file_z_buf[16];
+		char *file_x = base36_encode(region->key.x, file_x_buf, sizeof file_x_buf);
+		char *file_z = base36_encode(region->key.z, file_z_buf, sizeof file_z_buf);
+		char *file_path = g_strdup_printf("%s/r.%s.%s.mcr", region_path, file_x, file_z);
+
+		region->file = world_regfile_open(file_path);
+
+		for (jint cz = 0; cz < REGION_SIZE; cz++)
+		{
+			for (jint cx = 0; cx < REGION_SIZE; cx++)
+			{
+				/* NOTE: region->chunks in [cx][cz] order,
+				   while file->dirty_chunks the opposite (in-disk-file) order */
+				if (region->edits[cx][cz] || region->chunks[cx][cz])
+					region->file->dirty_chunks[cz][cx] = 1;
+			}
+		}
+	}
+}
+
+struct region_file *world_regfile_open(const char *path)
+{
+	/* open and/or create a new region file */
+
+	struct region_file *file = regfile_scan(path);
+	regfile_map(file);
+	return file;
+}
+
+static struct region_file *regfile_scan(const char *path)
+{
+	/* open or create the file, and read in the header */
+
+	struct region_file *file = g_malloc0(sizeof *file);
+
+	file->path = g_strdup(path);
+	file->lock = g_mutex_new();
+	file->fd = open(path, O_RDWR);
+
+	if (file->fd == -1)
+	{
+		if (errno != ENOENT)
+			dief("unable to read region file: %s: %s", path, g_strerror(errno));
+
+		/* the file does not seem to exist, so make a new empty one */
+
+		file->fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0666);
+		if (file->fd == -1)
+			dief("unable to create region file: %s: %s", path, g_strerror(errno));
+
+		if (ftruncate(file->fd, 2*SECTOR_SIZE) == -1)
+			dief("unable to prepare empty region file: %s: %s", path, g_strerror(errno));
+
+		file->nsect = 2;
+		file->sect_bitmap = g_byte_array_new();
+		g_byte_array_set_size(file->sect_bitmap, 1);
+		file->sect_bitmap->data[0] = 0x03; /* header sectors always taken */
+	}
+	else
+		regfile_read_header(file);
+
+	file->header = true;
+	return file;
+}
+
+static struct region_file *regfile_indexed(const char *path, struct index_entry *entry)
+{
+	/* a file known from the world index; the header is read when needed */
+
+	struct region_file *file = g_malloc0(sizeof *file);
+
+	file->path = g_strdup(path);
+	file->lock = g_mutex_new();
+	file->fd = -1;
+	file->header = false;
+	file->sect_bitmap = g_byte_array_new();
+	memcpy(file->tstamps, entry->tstamps, sizeof file->tstamps);
+
+	return file;
+}
+
+static void regfile_read_header(struct region_file *file)
+{
+	/* scan index + length of an existing file */
+
+	const char *path = file->path;
+
+	if (file->fd == -1)
 	{
-		struct directed_packet *dpacket = g_async_queue_pop(worldq);
-		enum packet_origin from = dpacket->from;
-		packet_t *packet = dpacket->p;
-		g_free(dpacket);
+		file->fd = open(path, O_RDWR);
+		if (file->fd == -1)
+			dief("unable to read region file: %s: %s", path, g_strerror(errno));
+	}
 
-		struct buffer msg;
-		unsigned char *p;
-		jint t;
-		jlong tl;
+	uint8_t header_loc[REGION_SIZE][REGION_SIZE][4];
+	uint8_t header_tstamp[REGION_SIZE][REGION_SIZE][4];
 
-		switch (packet->type)
-		{
-		case PACKET_MAP_CHUNK:
-			p = &packet->bytes[packet->field_offset[6]];
-			handle_compressed_chunk(packet_int(packet, 0), packet_int(packet, 1), packet_int(packet, 2),
-			                        packet_int(packet, 3)+1, packet_int(packet, 4)+1, packet_int(packet, 5)+1,
-			                        (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3], &p[4], true);
-			break;
+	if (read(file->fd, header_loc, sizeof header_loc) != sizeof header_loc)
+		dief("unable to read region file header (loc): %s: %s", path, g_strerror(errno));
+	if (read(file->fd, header_tstamp, sizeof header_tstamp) != sizeof header_tstamp)
+		dief("unable to read region file header (tstamp): %s: %s", path, g_strerror(errno));
 
-		case PACKET_MULTI_BLOCK_CHANGE:
-			p = &packet->bytes[packet->field_offset[2]];
-			t = (p[0] << 8) | p[1];
-			handle_multi_set_block(packet_int(packet, 0), packet_int(packet, 1),
-			                       t, p+2, p+2+t*2);
-			break;
+	off_t len = lseek(file->fd, 0, SEEK_END);
+	if (len == (off_t)-1)
+		dief("unable to find size of region file: %s: %s", path, g_strerror(errno));
 
-		case PACKET_BLOCK_CHANGE:
-			handle_set_block(packet_int(packet, 0),
-			                 packet_int(packet, 1),
-			                 packet_int(packet, 2),
-			                 packet_int(packet, 3));
-			break;
+	if (len < 2*SECTOR_SIZE)
+		dief("corrupted region file: %s: truncated header", path);
+	if (len % SECTOR_SIZE != 0)
+	{
+		/* not full multiple of sector size, round to avoid problems */
+		len += SECTOR_SIZE - (len%SECTOR_SIZE);
+		if (ftruncate(file->fd, len) == -1)
+			dief("unable to round region file to sector size: %s: %s", path, g_strerror(errno));
+	}
 
-		case PACKET_LOGIN_REQUEST:
-			if (from == PACKET_FROM_SERVER)
+	file->nsect = len / SECTOR_SIZE;
+
+	if (file->sect_bitmap)
+		g_byte_array_free(file->sect_bitmap, true);
+	file->sect_bitmap = g_byte_array_sized_new((file->nsect + 7) / 8);
+	g_byte_array_set_size(file->sect_bitmap, (file->nsect + 7) / 8);
+	memset(file->sect_bitmap->data, 0, file->sect_bitmap->len);
+	file->sect_bitmap->data[0] = 0x03;
+
+	/* parse the header and initialize the data structures */
+
+	for (jint z = 0; z < REGION_SIZE; z++)
+	{
+		for (jint x = 0; x < REGION_SIZE; x++)
+		{
+			file->offsets[z][x] = header_loc[z][x][0] << 16 | header_loc[z][x][1] << 8 | header_loc[z][x][2];
+			file->sects[z][x] = header_loc[z][x][3];
+			file->tstamps[z][x] = jint_read(header_tstamp[z][x]);
+
+			if (!file->offsets[z][x] || !file->sects[z][x])
+				continue; /* non-existing block, does not use sectors */
+
+			/* a damaged entry only loses the chunk, as if it were not there */
+			const char *error = 0;
+			if (file->offsets[z][x] < 2)
+				error = "chunk sectors overlap the header";
+			else if (file->offsets[z][x] + file->sects[z][x] > file->nsect)
+				error = "chunk sectors beyond end of file";
+			if (error)
 			{
-				entity_player = packet_int(packet, 0);
-				world_seed = packet_long(packet, 3);
+				log_print("[WARN] Ignoring chunk %d,%d in region file: %s: %s", x, z, path, error);
+				file->offsets[z][x] = 0;
+				file->sects[z][x] = 0;
+				continue;
 			}
-			break;
 
-		case PACKET_PLAYER_LOOK:
-			update_player_dir(packet_double(packet, 0));
-			break;
+			regfile_mark_sectors(file, file->offsets[z][x], file->sects[z][x], true);
+		}
+	}
 
-		case PACKET_PLAYER_POSITION_AND_LOOK:
-			update_player_dir(packet_double(packet, 4));
+	file->header = true;
+}
 
-			/* fall-thru to PACKET_PLAYER_POSITION */
+static void regfile_map(struct region_file *file)
+{
+	/* create shared memory mapping for file contents */
+	log_print("world_regfile_open: %s", file->path);
 
-		case PACKET_PLAYER_POSITION:
-			if (entity_vehicle < 0)
-				update_player_pos(packet_double(packet, 0),
-				                  packet_double(packet, 1),
-				                  packet_double(packet, 3));
+	if (file->fd == -1)
+	{
+		file->fd = open(file->path, O_RDWR);
+		if (file->fd == -1)
+			dief("unable to read region file: %s: %s", file->path, g_strerror(errno));
+	}
 
-			if (from == PACKET_FROM_SERVER && !spawn_known)
-			{
-				spawn_known = true;
-				spawn_x = packet_double(packet, 0);
-				spawn_y = packet_double(packet, 1);
-				spawn_z = packet_double(packet, 3);
-			}
+	void *addr;
+	file->contents_map = make_mmap(file->fd, file->nsect*SECTOR_SIZE, &addr);
+	file->contents = addr;
 
-			break;
+	if (!file->contents)
+		dief("unable to map region file to memory: %s: %s", file->path, g_strerror(errno));
+}
 
+static void regfile_remap(struct region_file *file, unsigned old_nsect)
+{
+	/* redo the file mapping if we have had to add new chunks;
+	   otherwise just tell the system the file has changed */
 
-		case PACKET_NAMED_ENTITY_SPAWN:
-			entity_add(packet_int(packet, 0),
-			           ENTITY_PLAYER,
-			           0,
-			           packet_string(packet, 1).data,
-			           packet_int(packet, 2),
-			           packet_int(packet, 3),
-			           packet_int(packet, 4));
-			break;
+	if (file->nsect != old_nsect)
+	{
+		void *new_addr;
+		file->contents_map = resize_mmap(file->contents_map, file->contents, file->fd,
+		                                 old_nsect*SECTOR_SIZE, file->nsect*SECTOR_SIZE, &new_addr);
+		if (!new_addr)
+			dief("unable to resize region file memory mapping: %s", g_strerror(errno));
+		file->contents = new_addr;
+	}
+	else
+		sync_mmap(file->contents, file->nsect*SECTOR_SIZE);
+}
 
-		case PACKET_PICKUP_SPAWN:
-			entity_add(packet_int(packet, 0),
-			           ENTITY_PICKUP,
-			           packet_int(packet, 1),
-			           0,
-			           packet_int(packet, 4),
-			           packet_int(packet, 5),
-			           packet_int(packet, 6));
-			break;
+static void regfile_mark_sectors(struct region_file *file, unsigned start, unsigned n, bool used)
+{
+	for (unsigned s = start; s < start + n; s++)
+	{
+		if (used)
+			file->sect_bitmap->data[s/8] |= 1 << (s%8);
+		else
+			file->sect_bitmap->data[s/8] &= ~(1 << (s%8));
+	}
+}
 
-		case PACKET_MOB_SPAWN:
-			entity_add(packet_int(packet, 0),
-			           ENTITY_MOB,
-			           packet_int(packet, 1),
-			           0,
-			           packet_int(packet, 2),
-			           packet_int(packet, 3),
-			           packet_int(packet, 4));
-			break;
+static unsigned regfile_alloc(struct region_file *file, unsigned n)
+{
+	/* best fit: the smallest run of at least n free sectors, 0 if none */
 
-		case PACKET_DESTROY_ENTITY:
-			entity_del(packet_int(packet, 0));
-			break;
+	unsigned char *bitmap = file->sect_bitmap->data;
+	unsigned best = 0, best_len = 0;
 
-		case PACKET_ENTITY_RELATIVE_MOVE:
-		case PACKET_ENTITY_LOOK_AND_RELATIVE_MOVE:
-			entity_move(packet_int(packet, 0),
-			            packet_int(packet, 1),
-			            packet_int(packet, 2),
-			            packet_int(packet, 3),
-			            1);
-			break;
+	for (unsigned s = 2; s < file->nsect; )
+	{
+		if (s % 8 == 0 && bitmap[s/8] == 0xff)
+		{
+			s += 8;
+			continue;
+		}
+		if (bitmap[s/8] & (1 << (s%8)))
+		{
+			s++;
+			continue;
+		}
 
-		case PACKET_ENTITY_TELEPORT:
-			entity_move(packet_int(packet, 0),
-			            packet_int(packet, 1),
-			            packet_int(packet, 2),
-			            packet_int(packet, 3),
-			            0);
-			break;
+		unsigned start = s;
+		while (s < file->nsect && !(bitmap[s/8] & (1 << (s%8))))
+			s++;
 
-		case PACKET_ATTACH_ENTITY:
-			if (packet_int(packet, 0) == entity_player)
+		unsigned len = s - start;
+		if (len >= n && (!best_len || len < best_len))
+		{
+			best = start;
+			best_len = len;
+			if (len == n)
+				break; /* can't do better */
+		}
+	}
+
+	return best;
+}
+
+static unsigned regfile_write_data(struct region_file *file, struct buffer data)
+{
+	/* put compressed chunk data into free sectors of the file, and return
+	   the first; caller must hold the lock and regfile_remap, and the
+	   header only points there after regfile_set_location */
+
+	unsigned new_sects = (data.len + 5 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	unsigned offset = regfile_alloc(file, new_sects);
+
+	if (offset)
+	{
+		unsigned char *bytes = &file->contents[offset * SECTOR_SIZE];
+		jint_write(bytes, data.len);
+		bytes[4] = 0x02; /* compression type: zlib */
+		memcpy(bytes + 5, data.data, data.len);
+	}
+	else
+	{
+		/* no hole big enough; append to file */
+		uint8_t hdr[5];
+		jint_write(hdr, data.len);
+		hdr[4] = 0x02;
+		if (lseek(file->fd, 0, SEEK_END) == -1 ||
+		    write(file->fd, hdr, 5) != 5 ||
+		    write(file->fd, data.data, data.len) != data.len ||
+		    ftruncate(file->fd, (file->nsect + new_sects)*SECTOR_SIZE) == -1)
+			dief("IO error when appending to region file: %s", g_strerror(errno));
+
+		/* update sector bitmap array size */
+		unsigned old_len = file->sect_bitmap->len;
+		g_byte_array_set_size(file->sect_bitmap, (file->nsect + new_sects + 7) / 8);
+		memset(file->sect_bitmap->data + old_len, 0, file->sect_bitmap->len - old_len);
+
+		offset = file->nsect;
+		file->nsect += new_sects;
+	}
+
+	regfile_mark_sectors(file, offset, new_sects, true);
+	return offset;
+}
+
+static void regfile_set_location(struct region_file *file, jint cx, jint cz, unsigned offset, unsigned sects)
+{
+	/* point the header at chunk data written before; the sectors of the
+	   old copy stay taken, for the caller to release once the new header
+	   is durable; caller must hold the lock */
+
+	file->offsets[cz][cx] = offset;
+	file->sects[cz][cx] = sects;
+	unsigned char *bytes = &file->contents[(cz*REGION_SIZE+cx)*4];
+	bytes[0] = offset >> 16;
+	bytes[1] = offset >> 8;
+	bytes[2] = offset;
+	bytes[3] = sects;
+}
+
+static void regfile_new_version(struct region_file *file, jint cx, jint cz)
+{
+	/* the timestamp doubles as the chunk's content version, so it must
+	   change whenever new contents are written; caller holds the lock */
+
+	jint tstamp = time(0);
+	if (tstamp <= file->tstamps[cz][cx])
+		tstamp = file->tstamps[cz][cx] + 1;
+
+	file->tstamps[cz][cx] = tstamp;
+	jint_write(&file->contents[SECTOR_SIZE + (cz*REGION_SIZE+cx)*4], tstamp);
+}
+
+static struct buffer chunk_stored(unsigned char *bytes, size_t room, const char **error)
+{
+	/* the compressed data of a chunk stored at bytes, with room bytes
+	   left in its sectors: a length word, the compression type, then
+	   the data; mcmap counts only the data in the length, Minecraft
+	   also counts the type byte, so both are accepted */
+
+	if (room < 5)
+	{
+		*error = "no room for the chunk header";
+		return (struct buffer){ 0 };
+	}
+
+	if (bytes[4] != 0x02)
+	{
+		*error = "unknown compression type";
+		return (struct buffer){ 0 };
+	}
+
+	jint len = jint_read(bytes);
+	if (len < 1 || (size_t)len > room - 4)
+	{
+		*error = "bad chunk length";
+		return (struct buffer){ 0 };
+	}
+
+	if ((size_t)len > room - 5)
+		len = room - 5;
+
+	return (struct buffer){ len, bytes + 5 };
+}
+
+static struct buffer regfile_chunk_data(struct region_file *file, jint cx, jint cz)
+{
+	/* locate the compressed chunk data in the mapping, if any */
+
+	if (!file->offsets[cz][cx] || !file->sects[cz][cx])
+		return (struct buffer){ 0 }; /* chunk not in file */
+
+	unsigned char *bytes = &file->contents[file->offsets[cz][cx] * SECTOR_SIZE];
+
+	/* a damaged header only loses the chunk, as if it were not there */
+
+	const char *error;
+	struct buffer buf = chunk_stored(bytes, file->sects[cz][cx] * SECTOR_SIZE, &error);
+	if (!buf.data)
+		log_print("[WARN] Ignoring chunk %d,%d in region file: %s: %s", cx, cz, file->path, error);
+
+	return buf;
+}
+
+static struct buffer regfile_copy_chunk(struct region_file *file, jint cx, jint cz)
+{
+	/* the persist thread may be moving the mapping around */
+
+	g_mutex_lock(file->lock);
+	struct buffer data = regfile_chunk_data(file, cx, cz);
+	if (data.len)
+		data.data = g_memdup(data.data, data.len);
+	g_mutex_unlock(file->lock);
+
+	return data;
+}
+
+static void regfile_apply_chunk(struct region *region, jint cx, jint cz, struct buffer *fields)
+{
+	struct buffer zb = fields[CHUNK_BLOCKS];
+#ifdef FEAT_FULLCHUNK
+	struct buffer zb_meta = fields[CHUNK_META];
+	struct buffer zb_light_blocks = fields[CHUNK_LIGHT_BLOCKS];
+	struct buffer zb_light_sky = fields[CHUNK_LIGHT_SKY];
+#else /* !FEAT_FULLCHUNK */
+	struct buffer zb_meta = { 0 };
+	struct buffer zb_light_blocks = { 0 };
+	struct buffer zb_light_sky = { 0 };
+#endif
+
+	/* region keys are in block coordinates */
+	coord_t cc = COORD(region->key.x + cx*CHUNK_XSIZE, region->key.z + cz*CHUNK_ZSIZE);
+
+	world_handle_chunk(cc.x, 0, cc.z,
+	                   CHUNK_XSIZE, CHUNK_YSIZE, CHUNK_ZSIZE,
+	                   zb, zb_meta, zb_light_blocks, zb_light_sky, false);
+
+	/* the map has nothing, or dropped what it had, for chunks only on disk */
+	memset(world_map_columns(cc), 0xff, sizeof ((struct column_update *)0)->columns);
+
+	/* freshly loaded, so identical to what is on disk */
+	region->file->dirty_chunks[cz][cx] = 0;
+	region->file->hashes[cz][cx] = chunk_hash(region->edits[cx][cz]);
+	g_atomic_int_set(&region->versions[cz*REGION_SIZE+cx], region->file->tstamps[cz][cx]);
+	g_hash_table_remove(unsaved, &cc);
+}
+
+static void regfile_load_chunk(struct region *region, jint cx, jint cz)
+{
+	/* any asynchronous load of the same chunk still in flight is stale now */
+	coord_t key = COORD(region->key.x + cx*CHUNK_XSIZE, region->key.z + cz*CHUNK_ZSIZE);
+	g_hash_table_remove(pending_loads, &key);
+
+	ensure_regfile(region);
+	struct buffer buf = regfile_copy_chunk(region->file, cx, cz);
+
+	if (!buf.len)
+		return;
+
+	struct buffer fields[CHUNK_NFIELDS];
+	const char *error;
+	struct buffer doc = chunk_parse(buf, fields, &error);
+	if (doc.data)
+		regfile_apply_chunk(region, cx, cz, fields);
+	else
+		chunk_skip(key, error);
+	g_free(doc.data);
+	g_free(buf.data);
+}
+
+void world_regfile_load(struct region *region)
+{
+	/* bring in everything that is still only in the file */
+
+	for (jint cz = 0; cz < REGION_SIZE; cz++)
+		for (jint cx = 0; cx < REGION_SIZE; cx++)
+			if (BITSET_TEST(region->evicted, cz*REGION_SIZE+cx))
 			{
-				jint new_vehicle = packet_int(packet, 1);
-				if (new_vehicle < 0)
-					log_print("[INFO] Unmounted vehicle %d normally", entity_vehicle);
-				else
-					log_print("[INFO] Mounted vehicle %d", new_vehicle);
-				entity_vehicle = packet_int(packet, 1);
+				BITSET_CLEAR(region->evicted, cz*REGION_SIZE+cx);
+				regfile_load_chunk(region, cx, cz);
 			}
-			break;
+}
+
+static void world_persist(void)
+{
+	/* hand everything unsaved over to the persist thread */
+
+	GArray *batch = g_array_new(false, false, sizeof(coord_t));
+
+	GHashTableIter iter;
+	coord_t *key;
+
+	g_hash_table_iter_init(&iter, unsaved);
+	while (g_hash_table_iter_next(&iter, (gpointer *) &key, NULL))
+	{
+		struct region *region = world_region(*key, false);
+		jint xo = CHUNK_XIDX(REGION_XOFF(key->x)), zo = CHUNK_ZIDX(REGION_ZOFF(key->z));
+
+		ensure_regfile(region);
 
-		case PACKET_TIME_UPDATE:
-			tl = packet_long(packet, 0);
-			tl %= 24000;
-			world_time = tl;
-			map_mode->update_time(map_mode->data);
-			break;
+		if (!region->file->dirty_chunks[zo][xo] || !region->chunks[xo][zo])
+			continue;
 
-		case PACKET_UPDATE_HEALTH:
-			player_health = packet_int(packet, 0);
-			break;
+		region->file->dirty_chunks[zo][xo] = 0;
 
-		case PACKET_CHAT_MESSAGE:
-			msg = packet_string(packet, 0);
-			if (msg.len >= 3 && msg.data[0] == '/' && msg.data[1] == '/')
+		/* edited, but maybe just to what it already was */
+		guint64 hash = chunk_hash(region->chunks[xo][zo]);
+		if (hash == region->file->hashes[zo][xo])
+		{
+			if (!g_hash_table_lookup(persisting, key))
 			{
-				struct buffer cmd = offset_buffer(msg, 2);
-				cmd_parse(cmd);
+				g_mutex_lock(region->file->lock);
+				jint tstamp = region->file->tstamps[zo][xo];
+				g_mutex_unlock(region->file->lock);
+				g_atomic_int_set(&region->versions[zo*REGION_SIZE+xo], tstamp);
 			}
-			g_free(msg.data);
-			break;
+			continue;
 		}
+		region->file->hashes[zo][xo] = hash;
 
-		packet_free(packet);
+		g_array_append_val(batch, *key);
+
+		struct persist_count *pc = g_hash_table_lookup(persisting, key);
+		if (!pc)
+		{
+			pc = g_new(struct persist_count, 1);
+			pc->key = *key;
+			pc->batches = 0;
+			g_hash_table_insert(persisting, &pc->key, pc);
+		}
+		pc->batches++;
 	}
 
-	return NULL;
-}
+	g_hash_table_remove_all(unsaved);
+	persist_now = false;
+	g_timer_start(persist_timer);
 
-/* world file IO routines */
+	g_atomic_int_add(&persist_backlog, batch->len);
 
-void world_regfile_sync_all(void)
+	/* the log up to here is redundant once this batch is on disk */
+	g_queue_push_tail(&wal_marks, GUINT_TO_POINTER(wal_seg));
+	wal_seg++;
+
+	g_async_queue_push(persistq, batch);
+}
+
+static void chunk_persisted(GArray *batch)
 {
-	/* FIXME testing code */
-	GHashTableIter region_iter;
-	struct region *region;
-	g_hash_table_iter_init(&region_iter, region_table);
-	while (g_hash_table_iter_next(&region_iter, NULL, (gpointer *)&region))
+	for (unsigned i = 0; i < batch->len; i++)
 	{
-		world_regfile_sync(region);
+		coord_t cc = g_array_index(batch, coord_t, i);
+		struct persist_count *pc = g_hash_table_lookup(persisting, &cc);
+		if (--pc->batches)
+			continue;
+		g_hash_table_remove(persisting, &cc);
+
+		/* the file has caught up with the published chunk, unless edited since;
+		   the persist thread may be writing other chunks of the file */
+		struct region *region = world_region(cc, false);
+		struct region_file *file = region->file;
+		jint xo = CHUNK_XIDX(REGION_XOFF(cc.x)), zo = CHUNK_ZIDX(REGION_ZOFF(cc.z));
+		if (!file->dirty_chunks[zo][xo] && !g_hash_table_lookup(unsaved, &cc))
+		{
+			g_mutex_lock(file->lock);
+			jint tstamp = file->tstamps[zo][xo];
+			g_mutex_unlock(file->lock);
+			g_atomic_int_set(&region->versions[zo*REGION_SIZE+xo], tstamp);
+		}
 	}
-}
 
-#define SECTOR_SIZE 4096
+	g_array_free(batch, true);
 
-static const char base36_chars[36] = "0123456789abcdefghijklmnopqrstuvwxyz";
+	wal_drop(GPOINTER_TO_UINT(g_queue_pop_head(&wal_marks)));
+}
 
-static char *base36_encode(jint value, char *buf, int bufsize)
+struct persist_job
 {
-	buf[bufsize-1] = 0;
-	bufsize -= 2;
+	coord_t key; /* chunk coordinates */
+	struct chunk *c; /* published version, or 0 when recompressing */
+	struct buffer old; /* recompressing: the data in the file */
+	jint tstamp; /* version of the data in the file */
+	int level;
+	struct buffer data; /* compressed */
+	unsigned offset; /* where the data was written */
+	unsigned prev_offset, prev_sects; /* where the replaced copy was */
+	GAsyncQueue *doneq;
+};
 
-	int neg = 0;
+struct cold_chunk
+{
+	coord_t key; /* chunk coordinates */
+	jint tstamp; /* version written */
+};
 
-	if (value < 0)
-		neg = 1, value = -value;
-	else if (value == 0)
+static GHashTable *cold_chunks = 0; /* persist thread only: chunk coord_t -> struct cold_chunk, written below the best level */
+
+static void cold_chunk_written(coord_t key, jint tstamp, int level)
+{
+	if (level >= PERSIST_LEVEL_BEST)
 	{
-		buf[bufsize] = '0';
-		return buf+bufsize;
+		g_hash_table_remove(cold_chunks, &key);
+		return;
 	}
 
-	while (value && bufsize >= 0)
+	struct cold_chunk *cold = g_hash_table_lookup(cold_chunks, &key);
+	if (!cold)
 	{
-		buf[bufsize--] = base36_chars[value % 36];
-		value /= 36;
+		if (g_hash_table_size(cold_chunks) >= PERSIST_COLD_MAX)
+			return; /* stays as it is, just a bit larger */
+		cold = g_new(struct cold_chunk, 1);
+		cold->key = key;
+		g_hash_table_insert(cold_chunks, &cold->key, cold);
 	}
+	cold->tstamp = tstamp;
+}
 
-	if (neg && bufsize >= 0)
-		buf[bufsize--] = '-';
+static double persist_headroom(void)
+{
+	/* the share of the CPUs not used by anything but compression since
+	   the last call; persist thread only */
 
-	return buf + bufsize + 1;
+	static GTimer *timer = 0;
+	static double last_wall = 0, last_cpu = 0, last_packing = 0;
+
+	if (!timer)
+		timer = g_timer_new();
+
+	double packing = 0;
+	G_LOCK(persist_stats);
+	for (unsigned level = 0; level < NELEMS(persist_stats); level++)
+		packing += persist_stats[level].secs;
+	G_UNLOCK(persist_stats);
+
+	double wall = g_timer_elapsed(timer, 0), cpu = cpu_time();
+	double used = (cpu - last_cpu) - (packing - last_packing);
+	double headroom = wall > last_wall ? 1.0 - used / ((wall - last_wall) * cpu_count()) : 1.0;
+
+	last_wall = wall;
+	last_cpu = cpu;
+	last_packing = packing;
+	return headroom;
+}
+
+static int persist_level(unsigned backlog, double headroom)
+{
+	unsigned i = 0;
+	while (backlog < persist_levels[i].backlog)
+		i++;
+	if (headroom < PERSIST_HEADROOM && i > 0)
+		i--;
+	return persist_levels[i].level;
 }
 
-static struct buffer compress_chunk(struct chunk *c)
+static struct buffer recompress(struct buffer old, int level, size_t *rawlen)
 {
-	/* dump the chunk data into compressed NBT */
+	/* inflate and deflate again; the contents need not even be parsed,
+	   and a chunk that does not inflate is left as it is */
 
-	struct nbt_tag *data = nbt_new_struct("Level");
+	const char *error;
+	struct buffer raw = nbt_inflate(old, 0, &error);
 
-	nbt_struct_add(data, nbt_new_blob("Blocks", NBT_TAG_BLOB, c->blocks, CHUNK_NBLOCKS));
-#ifdef FEAT_FULLCHUNK
-	nbt_struct_add(data, nbt_new_blob("Data", NBT_TAG_BLOB, c->meta, CHUNK_NBLOCKS/2));
-	nbt_struct_add(data, nbt_new_blob("BlockLight", NBT_TAG_BLOB, c->light_blocks, CHUNK_NBLOCKS/2));
-	nbt_struct_add(data, nbt_new_blob("SkyLight", NBT_TAG_BLOB, c->light_sky, CHUNK_NBLOCKS/2));
-	nbt_struct_add(data, nbt_new_blob("HeightMap", NBT_TAG_BLOB, c->height, CHUNK_XSIZE*CHUNK_ZSIZE)); /* TODO FIXME: indexing X/Z */
-#endif /* FEAT_FULLCHUNK */
+	*rawlen = raw.len;
+	if (!raw.data)
+		return raw;
 
-	/* TODO: Entities, TileEntities */
+	uLongf len = compressBound(raw.len);
+	struct buffer data = { .data = g_malloc(len) };
+	int ret = compress2(data.data, &len, raw.data, raw.len, level);
+	if (ret != Z_OK)
+		dief("zlib broke: compress2: %s", zError(ret));
+	data.len = len;
+
+	g_free(raw.data);
+	return data;
+}
+
+static void persist_compress(gpointer data, gpointer user_data)
+{
+	struct persist_job *job = data;
+	GTimer *timer = g_timer_new();
+	size_t rawlen;
 
-	nbt_struct_add(data, nbt_new_long("LastUpdate", 0));
+	if (job->c)
+		job->data = compress_chunk(job->c, job->level, &rawlen);
+	else
+		job->data = recompress(job->old, job->level, &rawlen);
 
-	nbt_struct_add(data, nbt_new_int("xPos", NBT_TAG_INT, c->key.x));
-	nbt_struct_add(data, nbt_new_int("zPos", NBT_TAG_INT, c->key.z));
+	double secs = g_timer_elapsed(timer, 0);
+	g_timer_destroy(timer);
 
-	nbt_struct_add(data, nbt_new_int("TerrainPopulated", NBT_TAG_BYTE, 1));
+	G_LOCK(persist_stats);
+	struct persist_stats *stats = &persist_stats[job->level];
+	stats->chunks++;
+	stats->raw += rawlen;
+	stats->packed += job->data.len;
+	stats->secs += secs;
+	G_UNLOCK(persist_stats);
 
-	struct buffer buf = nbt_compress(data);
-	nbt_free(data);
-	return buf;
+	g_async_queue_push(job->doneq, job);
 }
 
-static void ensure_regfile(struct region *region)
+static void persist_written(GPtrArray *written, struct region *region)
 {
-	if (region_path && !region->file)
+	for (unsigned r = 0; r < written->len; r++)
+		if (g_ptr_array_index(written, r) == region)
+			return;
+	g_ptr_array_add(written, region);
+}
+
+static void persist_sync(GPtrArray *written)
+{
+	for (unsigned r = 0; r < written->len; r++)
 	{
-		/* not loaded from disk, so assume new file */
-		/* open/create, and flag all existing chunks in region as dirty */
+		struct region *region = g_ptr_array_index(written, r);
+		struct region_file *file = region->file;
 
-		char file_x_buf[16], file_z_buf[16];
-		char *file_x = base36_encode(region->key.x, file_x_buf, sizeof file_x_buf);
-		char *file_z = base36_encode(region->key.z, file_z_buf, sizeof file_z_buf);
-		char *file_path = g_strdup_printf("%s/r.%s.%s.mcr", region_path, file_x, file_z);
+		/* most of it was written through the mapping; only this thread remaps */
+		if (flush_mmap(file->contents, file->nsect*SECTOR_SIZE) != 0 || sync_file(file->fd) != 0)
+			dief("IO error when syncing region file: %s: %s", file->path, g_strerror(errno));
+	}
+}
 
-		region->file = world_regfile_open(file_path);
+static void persist_place(GPtrArray *jobs, GPtrArray *written, bool new_version)
+{
+	/* the new copies of the chunks are in free sectors; once they are
+	   durable, the header is pointed at them, and once that is durable
+	   too, the old copies are given up; a crash leaves every chunk as it
+	   was or as it is now, and the log covering them goes away after */
 
-		for (jint cz = 0; cz < REGION_SIZE; cz++)
-		{
-			for (jint cx = 0; cx < REGION_SIZE; cx++)
-			{
-				/* NOTE: region->chunks in [cx][cz] order,
-				   while file->dirty_chunks the opposite (in-disk-file) order */
-				if (region->chunks[cx][cz])
-					region->file->dirty_chunks[cz][cx] = 1;
-			}
-		}
+	persist_sync(written);
+
+	for (unsigned i = 0; i < jobs->len; i++)
+	{
+		struct persist_job *job = g_ptr_array_index(jobs, i);
+		struct region_file *file = snapshot_region(job->key)->file;
+		jint xo = CHUNK_XIDX(REGION_XOFF(job->key.x)), zo = CHUNK_ZIDX(REGION_ZOFF(job->key.z));
+
+		g_mutex_lock(file->lock);
+		job->prev_offset = file->offsets[zo][xo];
+		job->prev_sects = file->sects[zo][xo];
+		regfile_set_location(file, xo, zo, job->offset, (job->data.len + 5 + SECTOR_SIZE - 1) / SECTOR_SIZE);
+		if (new_version)
+			regfile_new_version(file, xo, zo);
+		job->tstamp = file->tstamps[zo][xo];
+		g_mutex_unlock(file->lock);
+	}
+
+	persist_sync(written);
+
+	for (unsigned i = 0; i < jobs->len; i++)
+	{
+		struct persist_job *job = g_ptr_array_index(jobs, i);
+		struct region_file *file = snapshot_region(job->key)->file;
+
+		g_mutex_lock(file->lock);
+		if (job->prev_offset && job->prev_sects)
+			regfile_mark_sectors(file, job->prev_offset, job->prev_sects, false);
+		g_mutex_unlock(file->lock);
+	}
+
+	/* note the new state of the files in the world index */
+
+	for (unsigned r = 0; r < written->len; r++)
+	{
+		struct region *region = g_ptr_array_index(written, r);
+		struct region_file *file = region->file;
+
+		struct stat st;
+		if (fstat(file->fd, &st) != 0)
+			dief("unable to stat region file: %s: %s", file->path, g_strerror(errno));
+
+		g_mutex_lock(file->lock);
+		struct index_entry *entry = index_entry_new(region->key, file, &st);
+		g_mutex_unlock(file->lock);
+		g_hash_table_replace(index_entries, &entry->key, entry);
 	}
+
+	if (written->len)
+		index_save();
 }
 
-struct region_file *world_regfile_open(const char *path)
+static void persist_batch(GArray *batch, int level, GThreadPool *pool, GAsyncQueue *doneq)
 {
-	/* open and/or create a new region file */
-	log_print("world_regfile_open: %s", path);
+	/* the chunks of a batch are compressed in parallel, and written
+	   out one by one as they are done */
 
-	struct region_file *file = g_malloc0(sizeof *file);
+	GPtrArray *written = g_ptr_array_new(); /* struct region * */
+	GPtrArray *jobs = g_ptr_array_new(); /* struct persist_job *, written */
+	unsigned pending = 0;
 
-	file->fd = open(path, O_RDWR);
+	/* published versions never change, so no copies are needed */
+	int snap = world_snapshot_begin();
 
-	if (file->fd == -1)
+	for (unsigned i = 0; i < batch->len; i++)
 	{
-		if (errno != ENOENT)
-			dief("unable to read region file: %s: %s", path, g_strerror(errno));
+		struct persist_job *job = g_new(struct persist_job, 1);
+		job->key = g_array_index(batch, coord_t, i);
+		job->c = world_snapshot_chunk(job->key);
+		job->level = level;
+		job->doneq = doneq;
 
-		/* the file does not seem to exist, so make a new empty one */
+		if (!job->c)
+		{
+			g_free(job); /* cannot happen: not evictable until written */
+			continue;
+		}
 
-		file->fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0666);
-		if (file->fd == -1)
-			dief("unable to create region file: %s: %s", path, g_strerror(errno));
+		g_thread_pool_push(pool, job, 0);
+		pending++;
+	}
 
-		if (ftruncate(file->fd, 2*SECTOR_SIZE) == -1)
-			dief("unable to prepare empty region file: %s: %s", path, g_strerror(errno));
+	while (pending--)
+	{
+		struct persist_job *job = g_async_queue_pop(doneq);
 
-		file->nsect = 2;
-		file->sect_bitmap = g_byte_array_new();
-		g_byte_array_set_size(file->sect_bitmap, 1);
-		file->sect_bitmap->data[0] = 0x03; /* header sectors always taken */
+		struct region *region = snapshot_region(job->key);
+		struct region_file *file = region->file;
+
+		g_mutex_lock(file->lock);
+		unsigned old_nsect = file->nsect;
+		job->offset = regfile_write_data(file, job->data);
+		regfile_remap(file, old_nsect);
+		g_mutex_unlock(file->lock);
+
+		persist_written(written, region);
+		g_ptr_array_add(jobs, job);
 	}
-	else
+
+	world_snapshot_end(snap);
+
+	persist_place(jobs, written, true);
+
+	for (unsigned i = 0; i < jobs->len; i++)
 	{
-		/* file already existed, so scan index + length */
+		struct persist_job *job = g_ptr_array_index(jobs, i);
+
+		cold_chunk_written(job->key, job->tstamp, level);
+
+		g_free(job->data.data);
+		g_free(job);
+	}
+
+	g_ptr_array_free(jobs, true);
+	g_ptr_array_free(written, true);
+}
 
-		uint8_t header_loc[REGION_SIZE][REGION_SIZE][4];
-		uint8_t header_tstamp[REGION_SIZE][REGION_SIZE][4];
+static void persist_recompress(GThreadPool *pool, GAsyncQueue *doneq)
+{
+	/* the writer is idle: redo some of the chunks written in a hurry at
+	   the best level, unless written again since; only worth it if the
+	   new copy fits in a hole in the file */
+
+	GPtrArray *written = g_ptr_array_new(); /* struct region * */
+	GPtrArray *jobs = g_ptr_array_new(); /* struct persist_job *, written */
+	unsigned pending = 0, nchunks = 0, nsects = 0;
+
+	GHashTableIter cold_iter;
+	struct cold_chunk *cold;
+	g_hash_table_iter_init(&cold_iter, cold_chunks);
+
+	while (pending < PERSIST_RECOMPRESS && g_hash_table_iter_next(&cold_iter, NULL, (gpointer *) &cold))
+	{
+		struct region *region = snapshot_region(cold->key);
+		struct region_file *file = region->file;
+		jint xo = CHUNK_XIDX(REGION_XOFF(cold->key.x)), zo = CHUNK_ZIDX(REGION_ZOFF(cold->key.z));
 
-		if (read(file->fd, header_loc, sizeof header_loc) != sizeof header_loc)
-			dief("unable to read region file header (loc): %s: %s", path, g_strerror(errno));
-		if (read(file->fd, header_tstamp, sizeof header_tstamp) != sizeof header_tstamp)
-			dief("unable to read region file header (tstamp): %s: %s", path, g_strerror(errno));
+		struct buffer old = { .data = 0, .len = 0 };
 
-		off_t len = lseek(file->fd, 0, SEEK_END);
-		if (len == (off_t)-1)
-			dief("unable to find size of region file: %s: %s", path, g_strerror(errno));
+		g_mutex_lock(file->lock);
+		if (file->tstamps[zo][xo] == cold->tstamp)
+			old = regfile_chunk_data(file, xo, zo);
+		if (old.len)
+			old.data = g_memdup(old.data, old.len);
+		g_mutex_unlock(file->lock);
 
-		if (len < 2*SECTOR_SIZE)
-			dief("corrupted region file: %s: truncated header", path);
-		if (len % SECTOR_SIZE != 0)
+		if (old.len)
 		{
-			/* not full multiple of sector size, round to avoid problems */
-			len += SECTOR_SIZE - (len%SECTOR_SIZE);
-			if (ftruncate(file->fd, len) == -1)
-				dief("unable to round region file to sector size: %s: %s", path, g_strerror(errno));
+			struct persist_job *job = g_new(struct persist_job, 1);
+			job->key = cold->key;
+			job->c = 0;
+			job->old = old;
+			job->tstamp = cold->tstamp;
+			job->level = PERSIST_LEVEL_BEST;
+			job->doneq = doneq;
+			g_thread_pool_push(pool, job, 0);
+			pending++;
 		}
 
-		file->nsect = len / SECTOR_SIZE;
+		g_hash_table_iter_remove(&cold_iter);
+	}
 
-		file->sect_bitmap = g_byte_array_sized_new((file->nsect + 7) / 8);
-		g_byte_array_set_size(file->sect_bitmap, (file->nsect + 7) / 8);
-		file->sect_bitmap->data[0] = 0x03;
+	while (pending--)
+	{
+		struct persist_job *job = g_async_queue_pop(doneq);
 
-		/* parse the header and initialize the data structures */
+		struct region *region = snapshot_region(job->key);
+		struct region_file *file = region->file;
+		jint xo = CHUNK_XIDX(REGION_XOFF(job->key.x)), zo = CHUNK_ZIDX(REGION_ZOFF(job->key.z));
+		unsigned new_sects = (job->data.len + 5 + SECTOR_SIZE - 1) / SECTOR_SIZE;
 
-		for (jint z = 0; z < REGION_SIZE; z++)
+		g_mutex_lock(file->lock);
+		unsigned old_sects = file->sects[zo][xo];
+		if (job->data.len && file->tstamps[zo][xo] == job->tstamp && new_sects < old_sects && regfile_alloc(file, new_sects))
 		{
-			for (jint x = 0; x < REGION_SIZE; x++)
-			{
-				file->offsets[z][x] = header_loc[z][x][0] << 16 | header_loc[z][x][1] << 8 | header_loc[z][x][2];
-				file->sects[z][x] = header_loc[z][x][3];
-				file->tstamps[z][x] = jint_read(header_tstamp[z][x]);
-
-				if (!file->offsets[z][x] || !file->sects[z][x])
-					continue; /* non-existing block, does not use sectors */
-				if (file->offsets[z][x] + file->sects[z][x] > file->nsect)
-					dief("corrupted region file: %s: chunk sectors beyond end of file", path);
+			unsigned old_nsect = file->nsect;
+			job->offset = regfile_write_data(file, job->data);
+			regfile_remap(file, old_nsect);
+			persist_written(written, region);
+			g_ptr_array_add(jobs, job);
+			nchunks++;
+			nsects += old_sects - new_sects;
+			job = 0;
+		}
+		g_mutex_unlock(file->lock);
 
-				for (unsigned s = file->offsets[z][x], sc = 0; sc < file->sects[z][x]; s++, sc++)
-					file->sect_bitmap->data[s/8] |= 1 << (s%8);
-			}
+		if (job)
+		{
+			g_free(job->old.data);
+			g_free(job->data.data);
+			g_free(job);
 		}
 	}
 
-	/* create shared memory mapping for file contents */
+	/* the contents are the same, so the version stays */
+	persist_place(jobs, written, false);
 
-	void *addr;
-	file->contents_map = make_mmap(file->fd, file->nsect*SECTOR_SIZE, &addr);
-	file->contents = addr;
+	for (unsigned i = 0; i < jobs->len; i++)
+	{
+		struct persist_job *job = g_ptr_array_index(jobs, i);
+		g_free(job->old.data);
+		g_free(job->data.data);
+		g_free(job);
+	}
 
-	if (!file->contents)
-		dief("unable to map region file to memory: %s: %s", path, g_strerror(errno));
+	g_ptr_array_free(jobs, true);
+	g_ptr_array_free(written, true);
 
-	return file;
+	G_LOCK(persist_stats);
+	persist_recompressed += nchunks;
+	persist_sects_saved += nsects;
+	G_UNLOCK(persist_stats);
 }
 
-void world_regfile_sync(struct region *region)
+static gpointer persist_thread(gpointer data)
 {
-	ensure_regfile(region);
-	struct region_file *file = region->file;
+	int nthreads = opt.threads ? opt.threads : cpu_count();
 
-	/* for each dirty chunk, serialize and try to put it into file */
+	GAsyncQueue *doneq = g_async_queue_new();
+	GError *error = 0;
+	GThreadPool *pool = g_thread_pool_new(persist_compress, 0, nthreads, true, &error);
+	if (!pool)
+		dief("unable to start compression threads: %s", error->message);
 
-	unsigned old_nsect = file->nsect; /* used to notice size changes */
+	cold_chunks = g_hash_table_new_full(coord_glib_hash, coord_glib_equal, 0, g_free);
+	persist_headroom();
 
-	for (jint cz = 0; cz < REGION_SIZE; cz++)
+	while (1)
 	{
-		for (jint cx = 0; cx < REGION_SIZE; cx++)
-		{
-			if (!file->dirty_chunks[cz][cx] || !region->chunks[cx][cz])
-				continue; /* not dirty */
+		GArray *batch;
 
-			struct buffer data = compress_chunk(region->chunks[cx][cz]);
+		if (!g_hash_table_size(cold_chunks))
+			batch = g_async_queue_pop(persistq);
+		else
+		{
+			GTimeVal timeout;
+			g_get_current_time(&timeout);
+			g_time_val_add(&timeout, PERSIST_IDLE_USEC);
+			batch = g_async_queue_timed_pop(persistq, &timeout);
+		}
 
-			/* write the data portion */
+		if (!batch)
+		{
+			persist_recompress(pool, doneq);
+			continue;
+		}
 
-			unsigned new_sects = (data.len + 5 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+		/* everything waiting counts, this batch included */
+		int level = persist_level(g_atomic_int_get(&persist_backlog) / nthreads, persist_headroom());
+		persist_batch(batch, level, pool, doneq);
+		g_atomic_int_add(&persist_backlog, -(gint)batch->len);
 
-			if (new_sects <= file->sects[cz][cx])
-			{
-				/* fits in old slot; insert there */
-				unsigned char *bytes = &file->contents[file->offsets[cz][cx] * SECTOR_SIZE];
-				jint_write(bytes, data.len);
-				bytes[4] = 0x02; /* compression type: zlib */
-				memcpy(bytes + 5, data.data, data.len);
-			}
-			else
-			{
-				/* append to file */
-				uint8_t hdr[5];
-				jint_write(hdr, data.len);
-				hdr[4] = 0x02;
-				if (lseek(file->fd, 0, SEEK_END) == -1 ||
-				    write(file->fd, hdr, 5) != 5 ||
-				    write(file->fd, data.data, data.len) != data.len ||
-				    ftruncate(file->fd, (file->nsect + new_sects)*SECTOR_SIZE) == -1)
-					dief("IO error when appending to region file: %s", g_strerror(errno));
-				/* update sector bitmap array size */
-				g_byte_array_set_size(file->sect_bitmap, (file->nsect + new_sects + 7) / 8);
-			}
+		g_async_queue_push(persistdoneq, batch);
+	}
 
-			/* alter the necessary header and other fields */
+	return 0;
+}
 
-			if (new_sects < file->sects[cz][cx])
-			{
-				for (unsigned s = file->offsets[cz][cx] + new_sects, sc = new_sects;
-				     sc < file->sects[cz][cx];
-				     s++, sc++)
-					file->sect_bitmap->data[s/8] &= ~(1 << (s%8));
-				file->sects[cz][cx] = new_sects;
-				file->contents[(cz*REGION_SIZE+cx)*4+3] = new_sects;
-			}
-			else if (new_sects > file->sects[cz][cx])
-			{
-				for (unsigned s = file->offsets[cz][cx], sc = 0; sc < file->sects[cz][cx]; s++, sc++)
-					file->sect_bitmap->data[s/8] &= ~(1 << (s%8));
-				file->offsets[cz][cx] = file->nsect;
-				file->sects[cz][cx] = new_sects;
-				unsigned char *bytes = &file->contents[(cz*REGION_SIZE+cx)*4];
-				bytes[0] = file->nsect >> 16;
-				bytes[1] = file->nsect >> 8;
-				bytes[2] = file->nsect;
-				bytes[3] = new_sects;
-				file->nsect += new_sects;
-			}
-		}
+void world_persist_stats(void)
+{
+	if (!region_path)
+	{
+		tell("//stats: no world directory (-w) to save to");
+		return;
 	}
 
-	/* redo the file mapping if we have had to add new chunks;
-	   otherwise just tell the system the file has changed */
+	G_LOCK(persist_stats);
 
-	if (file->nsect != old_nsect)
+	for (unsigned level = 0; level < NELEMS(persist_stats); level++)
 	{
-		void *new_addr;
-		file->contents_map = resize_mmap(file->contents_map, file->contents, file->fd,
-		                                 old_nsect*SECTOR_SIZE, file->nsect*SECTOR_SIZE, &new_addr);
-		if (!new_addr)
-			dief("unable to resize region file memory mapping: %s", g_strerror(errno));
-		file->contents = new_addr;
+		struct persist_stats *stats = &persist_stats[level];
+		if (!stats->chunks)
+			continue;
+		tell("//stats: level %u: %u chunks, %.1f MB/s per thread, ratio %.2f",
+		     level, stats->chunks,
+		     stats->secs > 0 ? stats->raw / stats->secs / (1024*1024) : 0.0,
+		     stats->packed ? (double)stats->raw / stats->packed : 0.0);
 	}
-	else
-		sync_mmap(file->contents, file->nsect*SECTOR_SIZE);
+
+	tell("//stats: %d chunks waiting to be written; %u recompressed later, saving %u kB",
+	     g_atomic_int_get(&persist_backlog), persist_recompressed, persist_sects_saved * (SECTOR_SIZE/1024));
+
+	G_UNLOCK(persist_stats);
 }
 
-void world_regfile_load(struct region *region)
+static void regfile_free(struct region_file *file)
 {
-	ensure_regfile(region);
-	struct region_file *file = region->file;
+	/* only for files that were scanned, but never mapped */
+	if (file->fd != -1)
+		close(file->fd);
+	g_byte_array_free(file->sect_bitmap, true);
+	g_mutex_free(file->lock);
+	g_free(file->path);
+	g_free(file);
+}
+
+static guint64 regfile_compact(const char *path)
+{
+	/* copy all chunks to a new file, back to back in chunk order;
+	   returns the number of bytes saved */
+
+	struct region_file *file = regfile_scan(path);
+	guint64 old_size = (guint64)file->nsect * SECTOR_SIZE;
+
+	char *tmp_path = g_strdup_printf("%s.tmp", path);
+	int fd = open(tmp_path, O_RDWR|O_CREAT|O_TRUNC, 0666);
+	if (fd == -1)
+		dief("unable to create region file: %s: %s", tmp_path, g_strerror(errno));
+
+	uint8_t header[2][REGION_SIZE][REGION_SIZE][4];
+	memset(header, 0, sizeof header);
+
+	unsigned char *sectors = g_malloc(256 * SECTOR_SIZE);
+	unsigned nsect = 2;
+
+	if (lseek(fd, 2*SECTOR_SIZE, SEEK_SET) == -1)
+		dief("IO error when writing region file: %s: %s", tmp_path, g_strerror(errno));
 
 	for (jint cz = 0; cz < REGION_SIZE; cz++)
 	{
 		for (jint cx = 0; cx < REGION_SIZE; cx++)
 		{
-			if (!file->offsets[cz][cx] || !file->sects[cz][cx])
-				continue; /* chunk not in file */
+			unsigned sects = file->sects[cz][cx];
+			if (!file->offsets[cz][cx] || !sects)
+				continue;
+
+			if (lseek(file->fd, (off_t)file->offsets[cz][cx] * SECTOR_SIZE, SEEK_SET) == -1 ||
+			    read(file->fd, sectors, sects * SECTOR_SIZE) != sects * SECTOR_SIZE)
+				dief("IO error when reading region file: %s: %s", path, g_strerror(errno));
+
+			/* only keep as many sectors as the chunk really needs */
+			const char *error;
+			struct buffer data = chunk_stored(sectors, sects * SECTOR_SIZE, &error);
+			if (!data.data)
+			{
+				log_print("[WARN] Dropping chunk %d,%d from region file: %s: %s", cx, cz, path, error);
+				continue;
+			}
+			unsigned stored = data.len + 5;
+			unsigned used = (stored + SECTOR_SIZE - 1) / SECTOR_SIZE;
+			memset(sectors + stored, 0, used * SECTOR_SIZE - stored);
+
+			if (write(fd, sectors, used * SECTOR_SIZE) != used * SECTOR_SIZE)
+				dief("IO error when writing region file: %s: %s", tmp_path, g_strerror(errno));
+
+			uint8_t *loc = header[0][cz][cx];
+			loc[0] = nsect >> 16;
+			loc[1] = nsect >> 8;
+			loc[2] = nsect;
+			loc[3] = used;
+			jint_write(header[1][cz][cx], file->tstamps[cz][cx]);
 
-			unsigned char *bytes = &file->contents[file->offsets[cz][cx] * SECTOR_SIZE];
+			nsect += used;
+		}
+	}
 
-			if (bytes[4] != 0x02)
-				dief("unknown compression type in region file: %d", bytes[4]);
+	if (lseek(fd, 0, SEEK_SET) == -1 ||
+	    write(fd, header, sizeof header) != sizeof header)
+		dief("IO error when writing region file: %s: %s", tmp_path, g_strerror(errno));
 
-			jint len = jint_read(bytes);
-			if (len > file->sects[cz][cx] * SECTOR_SIZE)
-				die("compressed length of chunk larger than physically possible");
+	/* the new file has to be durable before it replaces the old one */
+	if (sync_file(fd) != 0)
+		dief("IO error when syncing region file: %s: %s", tmp_path, g_strerror(errno));
+	if (close(fd) != 0)
+		dief("IO error when writing region file: %s: %s", tmp_path, g_strerror(errno));
 
-			struct buffer buf = { .data = bytes+5, .len = len };
-			struct nbt_tag *chunk = nbt_uncompress(buf);
-			struct buffer zb = nbt_blob(nbt_struct_field(chunk, "Blocks"));
-#ifdef FEAT_FULLCHUNK
-			struct buffer zb_meta = nbt_blob(nbt_struct_field(chunk, "Data"));
-			struct buffer zb_light_blocks = nbt_blob(nbt_struct_field(chunk, "BlockLight"));
-			struct buffer zb_light_sky = nbt_blob(nbt_struct_field(chunk, "SkyLight"));
-#else /* !FEAT_FULLCHUNK */
-			struct buffer zb_meta = { 0 };
-			struct buffer zb_light_blocks = { 0 };
-			struct buffer zb_light_sky = { 0 };
-#endif
+	regfile_free(file);
+	g_free(sectors);
+
+	if (replace_file(tmp_path, path) != 0)
+		dief("unable to replace region file: %s: %s", path, g_strerror(errno));
+
+	char *dir_path = g_path_get_dirname(path);
+	if (sync_dir(dir_path) != 0)
+		dief("IO error when syncing region directory: %s: %s", dir_path, g_strerror(errno));
+	g_free(dir_path);
+	g_free(tmp_path);
+
+	/* chunks sharing sectors in a damaged header get one copy each, so
+	   the new file can come out larger than the old one */
+	guint64 new_size = (guint64)nsect * SECTOR_SIZE;
+	return old_size > new_size ? old_size - new_size : 0;
+}
+
+int world_compact(const char *path)
+{
+	/* offline: rewrite all region files of a world without holes */
+
+	char *dir_path = g_strdup_printf("%s/region", path);
+
+	GError *error = 0;
+	GDir *dir = g_dir_open(dir_path, 0, &error);
+	if (!dir)
+		dief("unable to scan region directory contents: %s", error->message);
+
+	unsigned nfiles = 0;
+	guint64 saved = 0;
+
+	const char *name;
+	while ((name = g_dir_read_name(dir)))
+	{
+		if (!g_str_has_prefix(name, "r.") || !g_str_has_suffix(name, ".mcr"))
+			continue;
+
+		char *file_path = g_strdup_printf("%s/%s", dir_path, name);
+		saved += regfile_compact(file_path);
+		g_free(file_path);
+		nfiles++;
+	}
+
+	g_dir_close(dir);
+	g_free(dir_path);
+
+	log_print("[INFO] Compacted %u region files, %" G_GUINT64_FORMAT " kB saved", nfiles, saved / 1024);
+	return 0;
+}
 
-			world_handle_chunk((region->key.x*REGION_SIZE + cx)*CHUNK_XSIZE,
-			                   0,
-			                   (region->key.z*REGION_SIZE + cz)*CHUNK_ZSIZE,
-			                   CHUNK_XSIZE, CHUNK_YSIZE, CHUNK_ZSIZE,
-			                   zb, zb_meta, zb_light_blocks, zb_light_sky, true);
+GPtrArray *world_chunk_corpus(const char *path, unsigned max)
+{
+	/* offline: copies of the compressed data of up to max chunks of a
+	   world, as struct buffer *; the region files are only read */
+
+	char *dir_path = g_strdup_printf("%s/region", path);
+
+	GError *error = 0;
+	GDir *dir = g_dir_open(dir_path, 0, &error);
+	if (!dir)
+		dief("unable to scan region directory contents: %s", error->message);
+
+	GPtrArray *chunks = g_ptr_array_new();
+
+	const char *name;
+	while (chunks->len < max && (name = g_dir_read_name(dir)))
+	{
+		if (!g_str_has_prefix(name, "r.") || !g_str_has_suffix(name, ".mcr"))
+			continue;
+
+		char *file_path = g_strdup_printf("%s/%s", dir_path, name);
+		gchar *contents;
+		gsize size;
+
+		if (!g_file_get_contents(file_path, &contents, &size, &error))
+			dief("unable to read region file: %s", error->message);
+
+		/* the same header check as regfile_scan, but only skipping the file */
+		if (size < 2*SECTOR_SIZE)
+			log_print("[WARN] Skipping region file with a truncated header: %s", file_path);
 
-			nbt_free(chunk);
+		for (unsigned i = 0; size >= 2*SECTOR_SIZE && i < REGION_SIZE*REGION_SIZE && chunks->len < max; i++)
+		{
+			unsigned char *loc = (unsigned char *) contents + 4*i;
+			size_t off = (size_t)(loc[0] << 16 | loc[1] << 8 | loc[2]) * SECTOR_SIZE;
+			size_t room = (size_t)loc[3] * SECTOR_SIZE;
+			if (off < 2*SECTOR_SIZE || off >= size)
+				continue;
+			if (room > size - off)
+				room = size - off;
+
+			const char *reason;
+			struct buffer data = chunk_stored((unsigned char *) contents + off, room, &reason);
+			if (!data.data)
+				continue;
+
+			struct buffer *buf = g_new(struct buffer, 1);
+			buf->len = data.len;
+			buf->data = g_memdup(data.data, data.len);
+			g_ptr_array_add(chunks, buf);
 		}
+
+		g_free(contents);
+		g_free(file_path);
 	}
+
+	g_dir_close(dir);
+	g_free(dir_path);
+
+	return chunks;
 }
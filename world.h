@@ -36,7 +36,11 @@ struct region_file;
 struct region
 {
 	coord_t key;
-	struct chunk *chunks[REGION_SIZE][REGION_SIZE];
+	struct chunk *chunks[REGION_SIZE][REGION_SIZE]; /* published versions */
+	struct chunk *edits[REGION_SIZE][REGION_SIZE]; /* world thread only: unpublished versions */
+	GList *lru[REGION_SIZE][REGION_SIZE]; /* world thread only: links in the chunk LRU list */
+	BITSET(evicted, REGION_SIZE*REGION_SIZE); /* chunks only in the file: not loaded yet, or freed */
+	gint versions[REGION_SIZE*REGION_SIZE]; /* file timestamp of the chunk if the file has the published contents, else 0 */
 	struct region_file *file; /* can be null when non-persistent */
 };
 
@@ -45,6 +49,8 @@ struct chunk
 	coord_t key;
 	unsigned char blocks[CHUNK_XSIZE][CHUNK_ZSIZE][CHUNK_YSIZE];
 	unsigned char height[CHUNK_XSIZE][CHUNK_ZSIZE];
+	unsigned char height_solid[CHUNK_XSIZE][CHUNK_ZSIZE]; /* topmost non-hollow block */
+	unsigned char water_depth[CHUNK_XSIZE][CHUNK_ZSIZE]; /* water blocks at top of stack */
 #ifdef FEAT_FULLCHUNK
 	unsigned char meta[CHUNK_NBLOCKS/2];
 	unsigned char light_blocks[CHUNK_NBLOCKS/2];
@@ -78,22 +84,36 @@ void world_start(const char *path);
 
 void world_push(struct directed_packet *dpacket);
 
+/* world thread only: the newest version of the world, and editable copies of it */
+
 struct region *world_region(coord_t cc, bool gen);
 struct chunk *world_chunk(coord_t cc, bool gen);
+struct chunk *world_chunk_edit(coord_t cc, bool gen);
 unsigned char *world_stack(coord_t cc, bool gen);
 
+/* any thread: published chunks, each valid until world_snapshot_end; they
+   are replaced one by one, not as a whole, so neighbours may differ in age */
+
+int world_snapshot_begin(void);
+void world_snapshot_end(int snap);
+struct chunk *world_snapshot_chunk(coord_t cc);
+bool world_region_exists(coord_t cc);
+bool world_chunk_evicted(coord_t cc);
+gint world_chunk_version(coord_t cc);
+void world_request_chunk(coord_t cc);
+void world_snapshot_entities(coord_t c1, coord_t c2, void (*func)(struct entity *e, void *userdata), void *userdata);
+
 bool world_handle_chunk(jint x0, jint y0, jint z0, jint xs, jint ys, jint zs, struct buffer zb, struct buffer zb_meta, struct buffer zb_light_blocks, struct buffer zb_light_sky, bool update_map);
 
 jint world_getheight(coord_t cc);
 
-extern GHashTable *world_entities;
-G_LOCK_EXTERN(entity_mutex);
-
 struct region_file *world_regfile_open(const char *path);
-void world_regfile_sync(struct region *region);
 void world_regfile_load(struct region *region);
 
-void world_regfile_sync_all(void); /* FIXME testing code */
+void world_flush(void);
+void world_persist_stats(void);
+int world_compact(const char *path);
+GPtrArray *world_chunk_corpus(const char *path, unsigned max);
 
 int world_save(char *dir);
 